@@ -1,12 +1,157 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
 #include <stdexcept>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
+#include "parallel-scan.h"
+#include "serializer.h"
 #include "set.h"
 
+// Опции bimap, передаются после компараторов в любом порядке:
+// bimap<L, R, CL, CR, bimap_policy::collect_stats>
+namespace bimap_policy {
+
+// Считать сравнения, повороты, swap_link, аллокации узлов (см. bimap::stats)
+struct collect_stats {};
+
+// Первые N узлов (N <= 64) лежат внутри объекта bimap: пока в нем не больше
+// N пар, bimap не делает аллокаций. Left и Right должны перемещаться без
+// исключений: swap переносит такие узлы между объектами, поэтому итераторы
+// на них после swap невалидны.
+template <std::size_t N>
+struct small_buffer {};
+
+// Кэш найденных узлов перед find_left, find_right и всем, что ищет через
+// них (at_*, erase_* по ключу): N слотов на сторону, N - степень двойки.
+// Слот выбирается std::hash ключа, попадание проверяется компаратором и
+// обходится без спуска по дереву. Нужен std::hash для Left и Right.
+// Поиск остается const, но пишет в кэш, поэтому одновременные поиски в
+// одном bimap из разных потоков нужно синхронизировать.
+template <std::size_t N>
+struct lookup_cache {};
+
+// Стороны с целыми ключами и std::less получают adaptive radix tree рядом
+// с деревом (intrusive::radix_index): поиск, lower_bound, upper_bound и
+// вставка спускаются по байтам ключа, а не по узлам дерева, порядок обхода
+// и flip по-прежнему дает дерево. Память индекса в stats не учитывается.
+struct radix_index {};
+
+// Узлы вне small_buffer живут в блоках (slab): места удаленных узлов
+// собираются в список и занимаются следующими вставками, новый блок на
+// size() узлов (не меньше 16) берется, когда места кончились. reserve(n)
+// готовит места заранее. Память блоков возвращается только деструктором и
+// compact. Связи узлов в блоках остаются указателями: 32-битные индексы
+// вместо них не сделаны, узлы занимают столько же, сколько без slab.
+struct slab_storage {};
+
+// Каждая пара несет изменяемое значение T в своем узле: it.payload()
+// доступен и через left_iterator, и через right_iterator. Новая пара
+// получает T(), копирование bimap и операции над множествами переносят
+// payload вместе с парой, save/load пишут и читают его рядом с парой.
+// operator==, diff и apply payload не сравнивают и не переносят.
+template <typename T>
+struct payload {};
+
+// Тип без данных на месте payload: [[no_unique_address]] не тратит на него
+// память узла
+struct no_payload {};
+
+template <typename... Options>
+struct payload_of {
+  using type = no_payload;
+};
+
+template <typename T, typename... Options>
+struct payload_of<payload<T>, Options...> {
+  using type = T;
+};
+
+template <typename Option, typename... Options>
+struct payload_of<Option, Options...> : payload_of<Options...> {};
+
+template <typename Option, typename... Options>
+inline constexpr bool has_option_v = (std::is_same_v<Option, Options> || ...);
+
+template <typename Option>
+struct inline_capacity : std::integral_constant<std::size_t, 0> {};
+
+template <std::size_t N>
+struct inline_capacity<small_buffer<N>>
+    : std::integral_constant<std::size_t, N> {};
+
+template <typename Option>
+struct cache_capacity : std::integral_constant<std::size_t, 0> {};
+
+template <std::size_t N>
+struct cache_capacity<lookup_cache<N>>
+    : std::integral_constant<std::size_t, N> {};
+
+} // namespace bimap_policy
+
+// Компаратор по проекции: bimap<L, R, by_projection<Proj>> упорядочивает
+// left по Compare{}(Proj{}(a), Proj{}(b)), хранит проекцию в узле рядом с
+// ключом и при поиске проецирует искомый ключ один раз. Proj и Compare
+// должны быть без состояния.
+template <typename Proj, typename Compare = std::less<>>
+using by_projection = intrusive::by_projection<Proj, Compare>;
+
+struct bimap_stats {
+  intrusive::set_stats left;
+  intrusive::set_stats right;
+  std::size_t allocations = 0;
+  std::size_t deallocations = 0;
+};
+
+struct lookup_cache_stats {
+  std::size_t hits = 0;
+  std::size_t misses = 0;
+};
+
+struct bimap_cache_stats {
+  lookup_cache_stats left;
+  lookup_cache_stats right;
+};
+
+// Изменения, переводящие один bimap в другой (см. diff и bimap::apply).
+// Все списки упорядочены по left.
+template <typename Left, typename Right>
+struct bimap_patch {
+  std::vector<Left> removed;                    // left, которых нет в цели
+  std::vector<std::pair<Left, Right>> added;    // пары, которых нет в исходном
+  std::vector<std::pair<Left, Right>> rebound;  // left с новым right
+
+  bool empty() const {
+    return removed.empty() && added.empty() && rebound.empty();
+  }
+};
+
+// Что сделали insert_or_assign_* и try_emplace_*
+enum class bimap_upsert {
+  found,     // пара уже была, bimap не изменился
+  inserted,  // добавлена пара с новым ключом
+  assigned,  // ключу назначено новое парное значение
+};
+
+// Пары из разных операндов bimap_union, bimap_intersection и
+// bimap_difference конфликтуют, если совпадают по одной стороне и
+// различаются по другой.
+enum class bimap_conflict {
+  keep_first,   // остается пара первого операнда
+  keep_second,  // остается пара второго операнда
+  drop,         // не остается ни одна из конфликтующих пар
+};
+
 template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
-          typename CompareRight = std::less<Right>>
+          typename CompareRight = std::less<Right>, typename... Options>
 struct bimap {
 
 private:
@@ -16,20 +161,174 @@ private:
   using left_t = Left;
   using right_t = Right;
 
-  struct node : intrusive::set_element<Left, LEFT_TAG>,
-                intrusive::set_element<Right, RIGHT_TAG> {
-    template <typename left_type, typename right_type>
-    node(left_type&& left, right_type&& right)
-        : intrusive::set_element<Left, LEFT_TAG>(std::forward<left_type>(left)),
-          intrusive::set_element<Right, RIGHT_TAG>(
-              std::forward<right_type>(right)) {}
+  static constexpr bool collect_stats =
+      bimap_policy::has_option_v<bimap_policy::collect_stats, Options...>;
+  static constexpr std::size_t inline_capacity =
+      (bimap_policy::inline_capacity<Options>::value + ... + 0);
+
+  static constexpr std::size_t cache_capacity =
+      (bimap_policy::cache_capacity<Options>::value + ... + 0);
+
+  static constexpr bool slab_storage =
+      bimap_policy::has_option_v<bimap_policy::slab_storage, Options...>;
+  static constexpr std::size_t min_slab_block = 16;
+
+  static constexpr bool radix_index =
+      bimap_policy::has_option_v<bimap_policy::radix_index, Options...>;
+  static constexpr bool radix_left =
+      radix_index && intrusive::radix_indexable_v<Left, CompareLeft>;
+  static constexpr bool radix_right =
+      radix_index && intrusive::radix_indexable_v<Right, CompareRight>;
+
+  // Компаратор, который берет bimap из перемещаемого (см. take_compare)
+  template <typename Compare>
+  static constexpr bool nothrow_take_compare =
+      (!std::is_copy_constructible_v<Compare> ||
+       std::is_nothrow_copy_constructible_v<Compare>) &&
+      std::is_nothrow_move_constructible_v<Compare>;
+  static constexpr bool nothrow_compare_take =
+      nothrow_take_compare<CompareLeft> && nothrow_take_compare<CompareRight>;
+  static constexpr bool nothrow_compare_swap =
+      std::is_nothrow_swappable_v<CompareLeft> &&
+      std::is_nothrow_swappable_v<CompareRight>;
+
+  using payload_t = typename bimap_policy::payload_of<Options...>::type;
+  static constexpr bool has_payload =
+      !std::is_same_v<payload_t, bimap_policy::no_payload>;
+
+  static_assert(!radix_index || radix_left || radix_right,
+                "radix_index needs an integral side ordered by std::less");
+  static_assert(inline_capacity <= 64, "small_buffer holds at most 64 nodes");
+  static_assert((cache_capacity & (cache_capacity - 1)) == 0,
+                "lookup_cache size must be a power of two");
+  static_assert(inline_capacity == 0 ||
+                    (std::is_nothrow_move_constructible_v<Left> &&
+                     std::is_nothrow_move_constructible_v<Right> &&
+                     std::is_nothrow_move_constructible_v<payload_t>),
+                "small_buffer relocates nodes and needs noexcept moves");
+  static_assert(std::is_default_constructible_v<payload_t>,
+                "payload of a new pair is value-initialized");
+
+  template <typename Tag>
+  using element_t = std::conditional_t<
+      std::is_same_v<Tag, LEFT_TAG>,
+      intrusive::set_element<Left, LEFT_TAG,
+                             intrusive::key_cache_t<Left, CompareLeft>>,
+      intrusive::set_element<Right, RIGHT_TAG,
+                             intrusive::key_cache_t<Right, CompareRight>>>;
+
+  struct node : element_t<LEFT_TAG>, element_t<RIGHT_TAG> {
+    template <typename left_type, typename right_type,
+              typename... payload_args>
+    node(left_type&& left, right_type&& right, payload_args&&... args)
+        : element_t<LEFT_TAG>(std::forward<left_type>(left)),
+          element_t<RIGHT_TAG>(std::forward<right_type>(right)),
+          payload(std::forward<payload_args>(args)...) {}
+
+    [[no_unique_address]] payload_t payload;
   };
 
   using node_t = node;
 
+  template <std::size_t N>
+  struct inline_nodes {
+    alignas(node_t) std::byte slots[N][sizeof(node_t)];
+    std::uint64_t used = 0;
+
+    void* slot(std::size_t index) {
+      return slots[index];
+    }
+
+    node_t* node(std::size_t index) {
+      return std::launder(reinterpret_cast<node_t*>(slots[index]));
+    }
+
+    std::size_t index_of(node_t const* ptr) const {
+      auto address = reinterpret_cast<std::uintptr_t>(ptr);
+      auto begin = reinterpret_cast<std::uintptr_t>(slots);
+      if (address < begin || address >= begin + sizeof(slots)) {
+        return N;
+      }
+      return (address - begin) / sizeof(node_t);
+    }
+  };
+  struct no_inline_nodes {};
+
+  // Блок узлов: заголовок в первом слоте, узлы в остальных, первые live
+  // мест выданы. Без slab_storage это блок, в который compact сложил узлы:
+  // освободившиеся места не переиспользуются, блок освобождается вместе с
+  // последним узлом в нем. С slab_storage блоки связаны через next, block -
+  // тот, из которого выдаются новые места, освобожденные места всех блоков
+  // лежат в free_slots.
+  struct node_block {
+    std::size_t capacity;
+    std::size_t live = 0;
+    node_block* next = nullptr;
+
+    static node_block* allocate(std::size_t capacity) {
+      auto* memory = std::allocator<node_t>().allocate(capacity + 1);
+      return ::new (static_cast<void*>(memory)) node_block{capacity};
+    }
+
+    static void deallocate(node_block* block) {
+      std::allocator<node_t>().deallocate(reinterpret_cast<node_t*>(block),
+                                          block->capacity + 1);
+    }
+
+    node_t* slots() {
+      return reinterpret_cast<node_t*>(this) + 1;
+    }
+
+    bool owns(node_t const* ptr) {
+      std::less<node_t const*> less;
+      return !less(ptr, slots()) && less(ptr, slots() + capacity);
+    }
+  };
+
+  struct allocation_counters {
+    std::size_t allocations = 0;
+    std::size_t deallocations = 0;
+  };
+  struct no_counters {};
+
+  // Список идет через память самих освобожденных мест
+  struct free_slot {
+    free_slot* next;
+  };
+  struct free_list {
+    free_slot* head = nullptr;
+    std::size_t count = 0;
+  };
+  struct no_free_list {};
+
+  // Слоты хранят узлы, которые нашел поиск. Узел убирается из слота до
+  // того, как он разрушается, меняет ключ или уходит в другой bimap.
+  struct lookup_cache {
+    std::array<intrusive::set_element_base*, cache_capacity> slots{};
+    lookup_cache_stats counters;
+  };
+  struct lookup_caches {
+    lookup_cache left;
+    lookup_cache right;
+  };
+  struct no_lookup_caches {};
+
   std::size_t bimap_size = 0;
-  intrusive::set<Left, LEFT_TAG, CompareLeft> left_set;
-  intrusive::set<Right, RIGHT_TAG, CompareRight> right_set;
+  intrusive::set<Left, LEFT_TAG, CompareLeft, collect_stats, radix_left>
+      left_set;
+  intrusive::set<Right, RIGHT_TAG, CompareRight, collect_stats, radix_right>
+      right_set;
+  [[no_unique_address]] std::conditional_t<collect_stats, allocation_counters,
+                                           no_counters> node_counters;
+  [[no_unique_address]] std::conditional_t<inline_capacity == 0,
+                                           no_inline_nodes,
+                                           inline_nodes<inline_capacity>>
+      inline_storage;
+  [[no_unique_address]] mutable std::conditional_t<
+      cache_capacity == 0, no_lookup_caches, lookup_caches> caches;
+  node_block* block = nullptr;
+  [[no_unique_address]] std::conditional_t<slab_storage, free_list,
+                                           no_free_list> free_slots;
 
 public:
   template <class iterator_value, class iterator_tag,
@@ -41,7 +340,7 @@ public:
     using pointer = iterator_value*;
     using reference = iterator_value&;
 
-    template <typename A, typename B, typename C, typename D>
+    template <typename A, typename B, typename C, typename D, typename... E>
     friend struct bimap;
 
     base_iterator() = default;
@@ -67,9 +366,7 @@ public:
     }
 
     reference operator*() const {
-      return static_cast<intrusive::set_element<iterator_value, iterator_tag>&>(
-                 *ptr)
-          .value;
+      return static_cast<element_t<iterator_tag>&>(*ptr).value;
     }
     pointer operator->() const {
       return &operator*();
@@ -83,18 +380,22 @@ public:
         return other_type_iterator(ptr->parent);
       }
 
-      auto* tmp_node =
-          static_cast<intrusive::set_element<iterator_value, iterator_tag>*>(
-              ptr);
+      auto* tmp_node = static_cast<element_t<iterator_tag>*>(ptr);
       auto* tmp_lca_node = static_cast<node*>(tmp_node);
-      auto* other_tmp_node = static_cast<
-          intrusive::set_element<other_iterator_value, other_iterator_tag>*>(
-          tmp_lca_node);
+      auto* other_tmp_node =
+          static_cast<element_t<other_iterator_tag>*>(tmp_lca_node);
 
       return other_type_iterator(
           static_cast<intrusive::set_element_base*>(other_tmp_node));
     }
 
+    // Payload пары (см. bimap_policy::payload), общий для итераторов обеих
+    // сторон
+    template <bool Enabled = has_payload, std::enable_if_t<Enabled, int> = 0>
+    payload_t& payload() const {
+      return get_ptr_node_t()->payload;
+    }
+
     bool operator==(base_iterator const& other) const {
       return other.ptr == ptr;
     }
@@ -106,9 +407,7 @@ public:
     base_iterator(intrusive::set_element_base* ptr) : ptr(ptr) {}
 
     node_t* get_ptr_node_t() const {
-      auto* tmp_node =
-          static_cast<intrusive::set_element<iterator_value, iterator_tag>*>(
-              ptr);
+      auto* tmp_node = static_cast<element_t<iterator_tag>*>(ptr);
       return static_cast<node_t*>(tmp_node);
     }
 
@@ -127,30 +426,58 @@ public:
   }
 
   // Конструкторы от других и присваивания
-  bimap(bimap const& other) : bimap() {
+  // Копирует форму обоих деревьев за O(n) без вызовов компараторов.
+  // Если копирование элемента бросает, созданные узлы удаляются.
+  bimap(bimap const& other)
+      : bimap(other.left_set.cmp(), other.right_set.cmp()) {
+    std::unordered_map<node_t const*, node_t*> clones;
     try {
-      for (auto it = other.begin_left(); it != other.end_left(); ++it) {
-        insert(*it, *it.flip());
+      clones.reserve(other.bimap_size);
+      if constexpr (slab_storage) {
+        reserve(other.bimap_size);
       }
+      left_set.clone_shape(other.left_set, [&](auto* ptr) {
+        auto const* original = to_node<LEFT_TAG>(ptr);
+        auto& clone = clones[original];
+        clone = create_node(
+            static_cast<element_t<LEFT_TAG> const&>(*original).value,
+            static_cast<element_t<RIGHT_TAG> const&>(*original).value,
+            original->payload);
+        return to_base<LEFT_TAG>(clone);
+      });
     } catch (...) {
-      while (size() > 0) {
-        erase_left(begin_left());
+      for (auto [original, clone] : clones) {
+        if (clone) {
+          destroy_node(clone);
+        }
       }
       throw;
     }
+    right_set.clone_shape(other.right_set, [&](auto* ptr) {
+      return to_base<RIGHT_TAG>(clones.find(to_node<RIGHT_TAG>(ptr))->second);
+    });
+    bimap_size = other.bimap_size;
   }
 
-  bimap(bimap&& other) noexcept = default;
+  // Забирает узлы за O(1) (узлы из small_buffer переносятся), other
+  // остается пустым и пригодным: компараторы копируются, перемещаются
+  // только некопируемые
+  bimap(bimap&& other) noexcept(nothrow_compare_take)
+      : bimap(take_compare(static_cast<CompareLeft&>(other.left_set)),
+              take_compare(static_cast<CompareRight&>(other.right_set))) {
+    swap_contents(other);
+  }
 
   bimap& operator=(bimap const& other) {
-    if (*this != other) {
+    if (this != &other) {
       bimap(other).swap(*this);
     }
     return *this;
   }
 
-  bimap& operator=(bimap&& other) noexcept {
-    if (*this != other) {
+  bimap& operator=(bimap&& other) noexcept(nothrow_compare_take &&
+                                            nothrow_compare_swap) {
+    if (this != &other) {
       bimap(std::move(other)).swap(*this);
     }
     return *this;
@@ -160,7 +487,8 @@ public:
   // Инвалидирует все итераторы ссылающиеся на элементы этого bimap
   // (включая итераторы ссылающиеся на элементы следующие за последними).
   ~bimap() noexcept {
-    erase_left(begin_left(), end_left());
+    // Узлы разрушаются разбором дерева, без удалений с перебалансировкой
+    detach();
   }
 
   // Вставка пары (left, right), возвращает итератор на left.
@@ -219,27 +547,42 @@ public:
 
   // erase от ренжа, удаляет [first, last), возвращает итератор на последний
   // элемент за удаленной последовательностью
+  // Работает за O(log n + k): ренж вырезается из своего дерева целиком, а
+  // парные элементы удаляются из другого дерева по одному или его полной
+  // перестройкой, если удаляется заметная доля элементов
   left_iterator erase_left(left_iterator first, left_iterator last) {
-    while (first != last) {
-      auto tmp_it = first++;
-      remove(tmp_it);
-    }
-    return first;
+    erase_range<LEFT_TAG, RIGHT_TAG>(left_set, right_set, first.ptr, last.ptr);
+    return last;
   }
   right_iterator erase_right(right_iterator first, right_iterator last) {
-    while (first != last) {
-      auto tmp_it = first++;
-      remove(tmp_it.flip());
+    erase_range<RIGHT_TAG, LEFT_TAG>(right_set, left_set, first.ptr, last.ptr);
+    return last;
+  }
+
+  // Удаляет пары, для которых pred(left, right) истинно, и возвращает их
+  // число. pred вызывается по разу на пару в порядке left, если он бросает,
+  // bimap не меняется. Если удаляется заметная доля пар, оба дерева
+  // перестраиваются из оставшихся за O(n) без сравнений и поворотов, иначе
+  // пары вынимаются по одной за O(k log n).
+  template <typename Predicate>
+  friend std::size_t erase_if(bimap& b, Predicate pred) {
+    std::vector<node_t*> erased;
+    for (auto* ptr = b.left_set.begin_ptr(); ptr != b.left_set.end_ptr();
+         ptr = ptr->next()) {
+      if (visit_pair<LEFT_TAG>(ptr, pred)) {
+        erased.push_back(to_node<LEFT_TAG>(ptr));
+      }
     }
-    return first;
+    b.erase_nodes(erased);
+    return erased.size();
   }
 
   // Возвращает итератор по элементу. Если не найден - соответствующий end()
   left_iterator find_left(left_t const& left) const {
-    return left_iterator(left_set.find_ptr(left));
+    return left_iterator(find<LEFT_TAG>(left));
   }
   right_iterator find_right(right_t const& right) const {
-    return right_iterator(right_set.find_ptr(right));
+    return right_iterator(find<RIGHT_TAG>(right));
   }
 
   // Возвращает противоположный элемент по элементу
@@ -270,30 +613,82 @@ public:
   template <typename T = Right,
             std::enable_if_t<std::is_default_constructible_v<T>, int> = 0>
   right_t const& at_left_or_default(left_t const& key) {
-    auto it = find_left(key);
-    if (it == end_left()) {
-      auto tmp_default_value = right_t();
-      if (find_right(tmp_default_value) != end_right()) {
-        erase_right(tmp_default_value);
-      }
-      it = insert(key, std::move(tmp_default_value));
-    }
-    return *it.flip();
+    return *try_emplace_left(key).position.flip();
   }
 
   template <typename T = Left,
             std::enable_if_t<std::is_default_constructible_v<T>, int> = 0>
   left_t const& at_right_or_default(right_t const& key) {
-    auto it = find_right(key);
-    if (it == end_right()) {
-      auto tmp_default_value = left_t();
-      if (find_left(tmp_default_value) != end_left()) {
-        erase_left(tmp_default_value);
-      }
-      insert(std::move(tmp_default_value), key);
-      it = find_right(key);
-    }
-    return *it.flip();
+    return *try_emplace_right(key).position.flip();
+  }
+
+  // Итератор на пару и что с ней сделано. evicted - удалена другая пара,
+  // которой принадлежало новое парное значение.
+  template <typename Iterator>
+  struct upsert_result {
+    Iterator position;
+    bimap_upsert status;
+    bool evicted;
+  };
+
+  // Кладет пару (left, right): если left уже есть, его right заменяется.
+  // Пара, которой принадлежал right, удаляется, ее узел переиспользуется.
+  // По одному спуску в каждое дерево, аллокация только для новой пары без
+  // вытеснения. Если присваивание бросает, затронутая пара удаляется.
+  template <typename R>
+  upsert_result<left_iterator> insert_or_assign_left(left_t const& left,
+                                                     R&& right) {
+    auto&& value = as_value<right_t>(std::forward<R>(right));
+    return upsert<LEFT_TAG, RIGHT_TAG>(left_set.lower_bound(left), left,
+                                       std::forward<decltype(value)>(value));
+  }
+  template <typename R>
+  upsert_result<left_iterator> insert_or_assign_left(left_t&& left,
+                                                     R&& right) {
+    auto&& value = as_value<right_t>(std::forward<R>(right));
+    return upsert<LEFT_TAG, RIGHT_TAG>(left_set.lower_bound(left),
+                                       std::move(left),
+                                       std::forward<decltype(value)>(value));
+  }
+  template <typename L>
+  upsert_result<right_iterator> insert_or_assign_right(right_t const& right,
+                                                       L&& left) {
+    auto&& value = as_value<left_t>(std::forward<L>(left));
+    return upsert<RIGHT_TAG, LEFT_TAG>(right_set.lower_bound(right), right,
+                                       std::forward<decltype(value)>(value));
+  }
+  template <typename L>
+  upsert_result<right_iterator> insert_or_assign_right(right_t&& right,
+                                                       L&& left) {
+    auto&& value = as_value<left_t>(std::forward<L>(left));
+    return upsert<RIGHT_TAG, LEFT_TAG>(right_set.lower_bound(right),
+                                       std::move(right),
+                                       std::forward<decltype(value)>(value));
+  }
+
+  // Если left уже есть, ничего не делает и не создает right из args.
+  // Иначе как insert_or_assign_left с right, созданным из args.
+  template <typename... Args>
+  upsert_result<left_iterator> try_emplace_left(left_t const& left,
+                                                Args&&... args) {
+    return emplace<LEFT_TAG, RIGHT_TAG>(left, std::forward<Args>(args)...);
+  }
+  template <typename... Args>
+  upsert_result<left_iterator> try_emplace_left(left_t&& left,
+                                                Args&&... args) {
+    return emplace<LEFT_TAG, RIGHT_TAG>(std::move(left),
+                                        std::forward<Args>(args)...);
+  }
+  template <typename... Args>
+  upsert_result<right_iterator> try_emplace_right(right_t const& right,
+                                                  Args&&... args) {
+    return emplace<RIGHT_TAG, LEFT_TAG>(right, std::forward<Args>(args)...);
+  }
+  template <typename... Args>
+  upsert_result<right_iterator> try_emplace_right(right_t&& right,
+                                                  Args&&... args) {
+    return emplace<RIGHT_TAG, LEFT_TAG>(std::move(right),
+                                        std::forward<Args>(args)...);
   }
 
   // lower и upper bound'ы по каждой стороне
@@ -340,6 +735,39 @@ public:
     return bimap_size;
   }
 
+  // Вызывает f(left, right) для каждой пары. С bimap_execution::seq - по
+  // порядку в вызывающем потоке. С bimap_execution::par пары делятся на
+  // диапазоны подряд идущих элементов стороны (по поддеревьям верхних
+  // уровней), внутри диапазона порядок сохраняется, разные диапазоны
+  // обходятся одновременно. f не должна менять bimap. Исключение из f
+  // пробрасывается, часть пар тогда остается необойденной.
+  template <typename Execution, typename F>
+  void for_each_left(Execution const& policy, F f) const {
+    scan_for_each<LEFT_TAG>(policy, f);
+  }
+  template <typename Execution, typename F>
+  void for_each_right(Execution const& policy, F f) const {
+    scan_for_each<RIGHT_TAG>(policy, f);
+  }
+
+  // Сворачивает transform(left, right) всех пар через reduce, обходя их как
+  // for_each_*. Результаты диапазонов соединяются в порядке стороны, так что
+  // reduce должна быть ассоциативной, но может быть некоммутативной:
+  // результат равен reduce(...reduce(init, t1)..., tn).
+  template <typename Execution, typename T, typename Reduce,
+            typename Transform>
+  T reduce_left(Execution const& policy, T init, Reduce reduce,
+                Transform transform) const {
+    return scan_reduce<LEFT_TAG>(policy, std::move(init), reduce, transform);
+  }
+  template <typename Execution, typename T, typename Reduce,
+            typename Transform>
+  T reduce_right(Execution const& policy, T init, Reduce reduce,
+                 Transform transform) const {
+    return scan_reduce<RIGHT_TAG>(policy, std::move(init), reduce,
+                                  transform);
+  }
+
   bool operator==(bimap const& other) const {
     if (bimap_size != other.bimap_size) {
       return false;
@@ -354,48 +782,1319 @@ public:
           right_set.cmp()(*other_it.flip(), *it.flip())) {
         return false;
       }
-
-      return true;
     }
+    return true;
   }
 
   bool operator!=(bimap const& other) const {
     return !(*this == other);
   }
 
-  void swap(bimap& other) {
-    std::swap(left_set.m_root.left, other.left_set.m_root.left);
-    if (left_set.m_root.left) {
-      left_set.m_root.left->parent = &left_set.m_root;
+  void swap(bimap& other) noexcept(nothrow_compare_swap) {
+    using std::swap;
+    swap(static_cast<CompareLeft&>(left_set),
+         static_cast<CompareLeft&>(other.left_set));
+    swap(static_cast<CompareRight&>(right_set),
+         static_cast<CompareRight&>(other.right_set));
+    swap_contents(other);
+  }
+
+  // Строит patch, переводящий from в to, одним слиянием left-сторон за
+  // O(n + m). Используются компараторы from.
+  friend bimap_patch<Left, Right> diff(bimap const& from, bimap const& to) {
+    bimap_patch<Left, Right> patch;
+    auto it = from.begin_left();
+    auto other_it = to.begin_left();
+    while (it != from.end_left() || other_it != to.end_left()) {
+      if (other_it == to.end_left() ||
+          (it != from.end_left() && from.left_set.less(*it, *other_it))) {
+        patch.removed.push_back(*it++);
+      } else if (it == from.end_left() ||
+                 from.left_set.less(*other_it, *it)) {
+        patch.added.emplace_back(*other_it, *other_it.flip());
+        other_it++;
+      } else {
+        if (from.right_set.less(*it.flip(), *other_it.flip()) ||
+            from.right_set.less(*other_it.flip(), *it.flip())) {
+          patch.rebound.emplace_back(*other_it, *other_it.flip());
+        }
+        it++;
+        other_it++;
+      }
+    }
+    return patch;
+  }
+
+  // Готовит места так, чтобы следующие n вставок обошлись без аллокаций.
+  // Доступно только с bimap_policy::slab_storage.
+  template <bool Enabled = slab_storage, std::enable_if_t<Enabled, int> = 0>
+  void reserve(std::size_t n) {
+    std::size_t spare = free_slots.count;
+    if (block != nullptr) {
+      spare += block->capacity - block->live;
     }
-    if (other.left_set.m_root.left) {
-      other.left_set.m_root.left->parent = &other.left_set.m_root;
+    if (spare < n) {
+      add_block(n - spare);
     }
+  }
+
+  // Узлы, отданные detach: bimap уже пуст, а узлы разрушаются вызовами
+  // reclaim, остаток - деструктором. Объект можно передать в другой поток и
+  // разрушать узлы там:
+  //   std::thread([nodes = b.detach()]() mutable {}).detach();
+  // Деструкторы Left и Right тогда вызываются в этом потоке.
+  class detached_nodes {
+  public:
+    detached_nodes() = default;
 
-    std::swap(right_set.m_root.left, other.right_set.m_root.left);
-    if (right_set.m_root.left) {
-      right_set.m_root.left->parent = &right_set.m_root;
+    detached_nodes(detached_nodes&& other) noexcept
+        : root(std::exchange(other.root, nullptr)),
+          remaining(std::exchange(other.remaining, 0)),
+          block(std::exchange(other.block, nullptr)) {
+      swap_index(left_index, other.left_index);
+      swap_index(right_index, other.right_index);
     }
-    if (other.right_set.m_root.left) {
-      other.right_set.m_root.left->parent = &other.right_set.m_root;
+
+    detached_nodes& operator=(detached_nodes&& other) noexcept {
+      if (this != &other) {
+        detached_nodes(std::move(other)).swap(*this);
+      }
+      return *this;
     }
 
-    std::swap(bimap_size, other.bimap_size);
+    ~detached_nodes() {
+      reclaim(std::numeric_limits<std::size_t>::max());
+    }
+
+    void swap(detached_nodes& other) noexcept {
+      std::swap(root, other.root);
+      std::swap(remaining, other.remaining);
+      std::swap(block, other.block);
+      swap_index(left_index, other.left_index);
+      swap_index(right_index, other.right_index);
+    }
+
+    // Делает не больше budget шагов, на каждом шаге O(1) работы и не больше
+    // одного разрушенного узла, всего шагов меньше 2 * size(). Возвращает,
+    // разрушены ли все узлы. radix_index и блоки slab_storage освобождаются
+    // последним шагом.
+    bool reclaim(std::size_t budget) noexcept {
+      for (; budget != 0 && root != nullptr; budget--) {
+        if (root->left != nullptr) {
+          // Поворот вправо: левый сын поднимается в корень
+          auto* left = root->left;
+          root->left = left->right;
+          left->right = root;
+          root = left;
+        } else {
+          auto* node = to_node<LEFT_TAG>(std::exchange(root, root->right));
+          free_node(node);
+          remaining--;
+        }
+      }
+      if (root != nullptr) {
+        return false;
+      }
+      clear_index(left_index);
+      clear_index(right_index);
+      if constexpr (slab_storage) {
+        while (block != nullptr) {
+          node_block::deallocate(std::exchange(block, block->next));
+        }
+      }
+      return true;
+    }
+
+    // Сколько узлов осталось разрушить
+    std::size_t size() const {
+      return remaining;
+    }
+
+    bool empty() const {
+      return remaining == 0;
+    }
+
+  private:
+    friend bimap;
+
+    template <typename Index>
+    static void clear_index(Index& index) {
+      if constexpr (!std::is_empty_v<Index>) {
+        index.clear();
+      }
+    }
+
+    template <typename Index>
+    static void swap_index(Index& index, Index& other) {
+      if constexpr (!std::is_empty_v<Index>) {
+        index.swap(other);
+      }
+    }
+
+    void free_node(node_t* node) noexcept {
+      node->~node_t();
+      if constexpr (!slab_storage) {
+        // Места в блоках slab_storage освобождаются вместе с блоками
+        if (block != nullptr && block->owns(node)) {
+          if (--block->live == 0) {
+            node_block::deallocate(std::exchange(block, nullptr));
+          }
+        } else {
+          std::allocator<node_t>().deallocate(node, 1);
+        }
+      }
+    }
+
+    // Узлы связаны left и right своих элементов левой стороны
+    intrusive::set_element_base* root = nullptr;
+    std::size_t remaining = 0;
+    node_block* block = nullptr;
+    [[no_unique_address]] typename decltype(left_set)::index_type left_index;
+    [[no_unique_address]] typename decltype(right_set)::index_type
+        right_index;
+  };
+
+  // Отдает все пары в detached_nodes и оставляет bimap пустым. Пары из
+  // small_buffer разрушаются сразу, остальное за O(1) без обхода узлов.
+  // Итераторы на пары становятся невалидными. Счетчики stats не учитывают
+  // освобождения, сделанные detached_nodes.
+  detached_nodes detach() noexcept {
+    detached_nodes result;
+    clear_caches();
+    if constexpr (inline_capacity != 0) {
+      for (std::size_t i = 0; i < inline_capacity; i++) {
+        if (inline_storage.used >> i & 1) {
+          auto* node = inline_storage.node(i);
+          remove_links(node);
+          destroy_node(node);
+        }
+      }
+    }
+    result.root = left_set.release_tree(result.left_index);
+    right_set.release_tree(result.right_index);
+    result.remaining = std::exchange(bimap_size, 0);
+    result.block = std::exchange(block, nullptr);
+    if constexpr (slab_storage) {
+      free_slots = {};
+    }
+    return result;
+  }
+
+  // Переносит все узлы в один блок памяти в порядке left, чтобы обходы и
+  // запросы по диапазонам шли по памяти подряд. O(n) без сравнений, одна
+  // аллокация, значения перемещаются. Инвалидирует все итераторы. С
+  // bimap_policy::slab_storage освобождает все прежние блоки.
+  template <typename L = Left, typename R = Right, typename P = payload_t,
+            std::enable_if_t<std::is_nothrow_move_constructible_v<L> &&
+                                 std::is_nothrow_move_constructible_v<R> &&
+                                 std::is_nothrow_move_constructible_v<P>,
+                             int> = 0>
+  void compact() {
+    if (bimap_size == 0) {
+      if constexpr (slab_storage) {
+        release_blocks();
+      }
+      return;
+    }
+    auto* fresh = node_block::allocate(bimap_size);
+    if constexpr (collect_stats) {
+      node_counters.allocations++;
+    }
+    clear_caches();
+    for (auto* ptr = left_set.begin_ptr(); ptr != left_set.end_ptr();) {
+      auto* node = to_node<LEFT_TAG>(ptr);
+      auto* moved = relocate(*this, node, fresh->slots() + fresh->live++);
+      release(node);
+      ptr = to_base<LEFT_TAG>(moved)->next();
+    }
+    if constexpr (slab_storage) {
+      // Все узлы старых блоков уже перенесены
+      release_blocks();
+    }
+    block = fresh;
+  }
+
+  // Операции над bimap как над множествами пар. Операнды должны иметь
+  // эквивалентные компараторы, результат получает компараторы того
+  // операнда, чьи узлы он забирает. Меньший операнд (m пар) обходится по
+  // порядку с поиском в большем (n пар) от предыдущей найденной позиции:
+  // O(m log(n / m + 1)) сравнений left и O(m log n) сравнений right.
+  // Операнд-rvalue отдает свои узлы результату без аллокаций. Время
+  // укладывается в ту же оценку, только если больший операнд - rvalue там,
+  // где результат строится из него (union, difference с большим первым
+  // операндом): lvalue сначала копируется за O(n), хотя и без сравнений.
+  //
+  // Объединение: все пары обоих операндов, конфликты решает policy.
+  template <typename A, typename B,
+            std::enable_if_t<std::is_same_v<std::remove_cvref_t<A>, bimap> &&
+                                 std::is_same_v<std::remove_cvref_t<B>, bimap>,
+                             int> = 0>
+  friend bimap bimap_union(A&& a, B&& b,
+                           bimap_conflict policy = bimap_conflict::keep_first) {
+    if (a.size() < b.size()) {
+      return merge(bimap(std::forward<B>(b)), std::forward<A>(a),
+                   swapped(policy));
+    }
+    return merge(bimap(std::forward<A>(a)), std::forward<B>(b), policy);
+  }
+
+  // Пересечение: пары, которые есть в обоих операндах. При keep_first и
+  // keep_second к ним добавляются пары выбранного операнда, конфликтующие
+  // с парами другого.
+  template <typename A, typename B,
+            std::enable_if_t<std::is_same_v<std::remove_cvref_t<A>, bimap> &&
+                                 std::is_same_v<std::remove_cvref_t<B>, bimap>,
+                             int> = 0>
+  friend bimap
+  bimap_intersection(A&& a, B&& b,
+                     bimap_conflict policy = bimap_conflict::drop) {
+    if (a.size() <= b.size()) {
+      if (policy == bimap_conflict::keep_second) {
+        return pick_matched(std::forward<B>(b), a);
+      }
+      return keep_matched(bimap(std::forward<A>(a)), b,
+                          policy == bimap_conflict::keep_first);
+    }
+    if (policy == bimap_conflict::keep_first) {
+      return pick_matched(std::forward<A>(a), b);
+    }
+    return keep_matched(bimap(std::forward<B>(b)), a,
+                        policy == bimap_conflict::keep_second);
+  }
+
+  // Разность: пары первого операнда, которых нет во втором. Пара,
+  // конфликтующая с парой второго операнда, остается только при keep_first.
+  template <typename A, typename B,
+            std::enable_if_t<std::is_same_v<std::remove_cvref_t<A>, bimap> &&
+                                 std::is_same_v<std::remove_cvref_t<B>, bimap>,
+                             int> = 0>
+  friend bimap
+  bimap_difference(A&& a, B const& b,
+                   bimap_conflict policy = bimap_conflict::drop) {
+    bool keep_conflicts = policy == bimap_conflict::keep_first;
+    if (a.size() <= b.size()) {
+      bimap result(std::forward<A>(a));
+      for_each_node(result, [&, hint = b.left_set.end_ptr()](
+                                node_t* node) mutable {
+        auto [by_left, by_right] = b.match(node, hint);
+        if ((by_left != nullptr && by_left == by_right) ||
+            ((by_left != nullptr || by_right != nullptr) && !keep_conflicts)) {
+          result.remove_node(node);
+        }
+      });
+      return result;
+    }
+
+    bimap result(std::forward<A>(a));
+    std::vector<node_t*> removed;
+    for_each_node(b, [&, hint = result.left_set.end_ptr()](
+                         node_t* node) mutable {
+      auto [by_left, by_right] = result.match(node, hint);
+      if (by_left != nullptr && by_left == by_right) {
+        removed.push_back(by_left);
+      } else if (!keep_conflicts) {
+        for (auto* ptr : {by_left, by_right}) {
+          if (ptr != nullptr) {
+            removed.push_back(ptr);
+          }
+        }
+      }
+    });
+    result.remove_all(removed);
+    return result;
+  }
+
+  // Применяет patch, построенный diff(from, to) для from равного *this,
+  // после чего *this равен to. Поиск по left идет от предыдущей найденной
+  // позиции, поэтому k изменений стоят O(k log(n / k + 1)) сравнений left и
+  // O(k log n) сравнений right, аллоцируются только добавленные узлы.
+  // Изменения, противоречащие текущему содержимому (нет удаляемого left,
+  // добавляемый left или right уже занят), пропускаются, а пара, чей новый
+  // right уже занят, удаляется. Если копирование бросает, bimap остается
+  // корректным, но patch применен частично.
+  void apply(bimap_patch<Left, Right> const& patch) {
+    auto* hint = left_set.end_ptr();
+    for (auto const& left : patch.removed) {
+      auto* ptr = left_set.lower_bound_from(left, hint);
+      hint = before(ptr);
+      if (contains<LEFT_TAG>(ptr, left)) {
+        remove(left_iterator(ptr));
+      }
+    }
+
+    // Сначала вынимаем все перепривязываемые right, иначе обмен right между
+    // двумя парами выглядел бы как конфликт
+    std::vector<node_t*> rebound;
+    rebound.reserve(patch.rebound.size());
+    hint = left_set.end_ptr();
+    for (auto const& rebind : patch.rebound) {
+      auto* ptr = left_set.lower_bound_from(rebind.first, hint);
+      hint = before(ptr);
+      if (contains<LEFT_TAG>(ptr, rebind.first)) {
+        rebound.push_back(to_node<LEFT_TAG>(ptr));
+        right_set.unlink(to_base<RIGHT_TAG>(rebound.back()));
+      } else {
+        rebound.push_back(nullptr);
+      }
+    }
+    auto drop = [this](node_t* node) {
+      left_set.unlink(to_base<LEFT_TAG>(node));
+      destroy_node(node);
+      bimap_size--;
+    };
+    for (std::size_t i = 0; i < rebound.size(); i++) {
+      if (rebound[i] == nullptr) {
+        continue;
+      }
+      auto& element = static_cast<element_t<RIGHT_TAG>&>(*rebound[i]);
+      forget(rebound[i]);
+      try {
+        element.value = patch.rebound[i].second;
+        element.refresh_cache();
+      } catch (...) {
+        // Пары без right нельзя оставить, они удаляются
+        for (; i < rebound.size(); i++) {
+          if (rebound[i] != nullptr) {
+            drop(rebound[i]);
+          }
+        }
+        throw;
+      }
+      if (right_set.find_ptr(element.value) != right_set.end_ptr()) {
+        drop(rebound[i]);
+      } else {
+        right_set.insert(element);
+      }
+    }
+
+    hint = left_set.end_ptr();
+    for (auto const& [left, right] : patch.added) {
+      auto* ptr = left_set.lower_bound_from(left, hint);
+      hint = before(ptr);
+      if (contains<LEFT_TAG>(ptr, left) ||
+          right_set.find_ptr(right) != right_set.end_ptr()) {
+        continue;
+      }
+      auto* node = create_node(left, right);
+      right_set.insert(static_cast<element_t<RIGHT_TAG>&>(*node));
+      left_set.insert_before(static_cast<element_t<LEFT_TAG>&>(*node), ptr);
+      bimap_size++;
+      hint = to_base<LEFT_TAG>(node);
+    }
+  }
+
+  // Бинарный снимок: заголовок, пары в порядке left (с payload, если он
+  // есть) и перестановка, задающая порядок right. Типы сохраняются через
+  // bimap_serializer.
+  void save(std::ostream& out) const {
+    bimap_serializer<std::uint64_t>::save(out, snapshot_magic);
+    bimap_serializer<std::uint64_t>::save(out, bimap_size);
+
+    std::unordered_map<node_t const*, std::uint64_t> left_index;
+    left_index.reserve(bimap_size);
+    for (auto it = begin_left(); it != end_left(); ++it) {
+      bimap_serializer<Left>::save(out, *it);
+      bimap_serializer<Right>::save(out, *it.flip());
+      if constexpr (has_payload) {
+        bimap_serializer<payload_t>::save(out, it.payload());
+      }
+      left_index.emplace(it.get_ptr_node_t(), left_index.size());
+    }
+    for (auto it = begin_right(); it != end_right(); ++it) {
+      bimap_serializer<std::uint64_t>::save(
+          out, left_index.find(it.get_ptr_node_t())->second);
+    }
+  }
+
+  // Заменяет содержимое на снимок, сделанный save. Оба дерева собираются за
+  // O(n) без вызовов компараторов, поэтому компараторы должны совпадать с
+  // компараторами сохраненного bimap. Бросает std::runtime_error на битом
+  // снимке, в этом случае bimap не меняется.
+  void load(std::istream& in) {
+    if (bimap_serializer<std::uint64_t>::load(in) != snapshot_magic) {
+      throw std::runtime_error("bimap snapshot: bad header");
+    }
+    auto count = bimap_serializer<std::uint64_t>::load(in);
+
+    std::vector<node_t*> nodes;
+    try {
+      for (std::uint64_t i = 0; i < count; i++) {
+        auto left = bimap_serializer<Left>::load(in);
+        auto right = bimap_serializer<Right>::load(in);
+        nodes.push_back(nullptr);
+        if constexpr (has_payload) {
+          auto payload = bimap_serializer<payload_t>::load(in);
+          nodes.back() = create_node(std::move(left), std::move(right),
+                                     std::move(payload));
+        } else {
+          nodes.back() = create_node(std::move(left), std::move(right));
+        }
+        if (i > 0) {
+          to_base<LEFT_TAG>(nodes[i - 1])->left = to_base<LEFT_TAG>(nodes[i]);
+        }
+      }
+
+      intrusive::set_element_base* right_head = nullptr;
+      intrusive::set_element_base** right_tail = &right_head;
+      for (std::uint64_t i = 0; i < count; i++) {
+        auto index = bimap_serializer<std::uint64_t>::load(in);
+        // Высота 0 помечает уже использованный индекс
+        if (index >= count || to_base<RIGHT_TAG>(nodes[index])->height == 0) {
+          throw std::runtime_error("bimap snapshot: bad right order");
+        }
+        *right_tail = to_base<RIGHT_TAG>(nodes[index]);
+        (*right_tail)->height = 0;
+        right_tail = &(*right_tail)->left;
+      }
+
+      erase_left(begin_left(), end_left());
+      left_set.assemble(count == 0 ? nullptr : to_base<LEFT_TAG>(nodes[0]),
+                        count);
+      right_set.assemble(right_head, count);
+      bimap_size = count;
+    } catch (...) {
+      for (auto* ptr : nodes) {
+        if (ptr) {
+          destroy_node(ptr);
+        }
+      }
+      throw;
+    }
+  }
+
+#ifdef BIMAP_HAS_FD_STREAMS
+  void save(int fd) const {
+    serialization::fd_streambuf buffer(fd);
+    std::ostream out(&buffer);
+    save(out);
+    if (!out.flush()) {
+      throw std::runtime_error("bimap snapshot: write failed");
+    }
+  }
+
+  // Читает из fd с опережением, данные после снимка могут быть прочитаны
+  void load(int fd) {
+    serialization::fd_streambuf buffer(fd);
+    std::istream in(&buffer);
+    load(in);
+  }
+#endif
+
+  // Счетчики операций с момента создания или reset_stats и форма деревьев.
+  // Доступно только с bimap_policy::collect_stats, глубины считаются обходом
+  // деревьев за O(n).
+  template <bool Enabled = collect_stats, std::enable_if_t<Enabled, int> = 0>
+  bimap_stats stats() const {
+    bimap_stats result;
+    result.left = left_set.stats();
+    result.right = right_set.stats();
+    result.allocations = node_counters.allocations;
+    result.deallocations = node_counters.deallocations;
+    return result;
+  }
+
+  template <bool Enabled = collect_stats, std::enable_if_t<Enabled, int> = 0>
+  void reset_stats() {
+    left_set.reset_stats();
+    right_set.reset_stats();
+    node_counters = {};
+  }
+
+  // Попадания и промахи lookup_cache с момента создания или
+  // reset_cache_stats. Доступно только с bimap_policy::lookup_cache.
+  template <bool Enabled = cache_capacity != 0,
+            std::enable_if_t<Enabled, int> = 0>
+  bimap_cache_stats cache_stats() const {
+    return {caches.left.counters, caches.right.counters};
+  }
+
+  template <bool Enabled = cache_capacity != 0,
+            std::enable_if_t<Enabled, int> = 0>
+  void reset_cache_stats() {
+    caches.left.counters = {};
+    caches.right.counters = {};
   }
 
 private:
+  template <typename Compare>
+  static decltype(auto) take_compare(Compare& compare) {
+    if constexpr (std::is_copy_constructible_v<Compare>) {
+      return std::as_const(compare);
+    } else {
+      return std::move(compare);
+    }
+  }
+
+  // Снимок с payload отличается заголовком: bimap без payload его не примет
+  static constexpr std::uint64_t snapshot_magic =
+      has_payload ? 0x4249'4d41'5070'3031ULL : 0x4249'4d41'5076'3031ULL;
+
+  template <typename Tag>
+  static node_t* to_node(intrusive::set_element_base* ptr) {
+    return static_cast<node_t*>(static_cast<element_t<Tag>*>(ptr));
+  }
+
+  template <typename Tag>
+  static intrusive::set_element_base* to_base(node_t* ptr) {
+    return static_cast<element_t<Tag>*>(ptr);
+  }
+
+  template <typename Tag>
+  using value_t = std::conditional_t<std::is_same_v<Tag, LEFT_TAG>, left_t,
+                                     right_t>;
+
+  template <typename Tag>
+  using iterator_t = std::conditional_t<std::is_same_v<Tag, LEFT_TAG>,
+                                        left_iterator, right_iterator>;
+
+  template <typename Tag>
+  auto& set_of() {
+    if constexpr (std::is_same_v<Tag, LEFT_TAG>) {
+      return left_set;
+    } else {
+      return right_set;
+    }
+  }
+
+  template <typename Tag>
+  auto const& set_of() const {
+    if constexpr (std::is_same_v<Tag, LEFT_TAG>) {
+      return left_set;
+    } else {
+      return right_set;
+    }
+  }
+
+  template <typename Tag>
+  static auto& value_of(node_t* node) {
+    return static_cast<element_t<Tag>&>(*node).value;
+  }
+
+  template <typename Tag>
+  static value_t<Tag> const& value_of(intrusive::set_element_base* ptr) {
+    return static_cast<element_t<Tag>&>(*ptr).value;
+  }
+
+  template <typename Tag, typename F>
+  static decltype(auto) visit_pair(intrusive::set_element_base* ptr, F& f) {
+    auto* node = to_node<Tag>(ptr);
+    return f(std::as_const(value_of<LEFT_TAG>(node)),
+             std::as_const(value_of<RIGHT_TAG>(node)));
+  }
+
+  // Границы диапазонов обхода стороны Tag: begin, узлы верхних уровней
+  // дерева по порядку, end. Без параллельности диапазон один.
+  template <typename Tag>
+  std::vector<intrusive::set_element_base*>
+  scan_bounds(std::size_t threads) const {
+    auto const& set = set_of<Tag>();
+    std::vector<intrusive::set_element_base*> bounds{set.begin_ptr()};
+    if (threads > 1 && bimap_size >= bimap_execution::min_parallel_size) {
+      auto depth =
+          bit_width(threads * bimap_execution::tasks_per_thread - 1);
+      collect_bounds(set.m_root.left, depth, bounds);
+    }
+    bounds.push_back(set.end_ptr());
+    return bounds;
+  }
+
+  static void
+  collect_bounds(intrusive::set_element_base* ptr, std::size_t depth,
+                 std::vector<intrusive::set_element_base*>& bounds) {
+    if (ptr == nullptr || depth == 0) {
+      return;
+    }
+    collect_bounds(ptr->left, depth - 1, bounds);
+    bounds.push_back(ptr);
+    collect_bounds(ptr->right, depth - 1, bounds);
+  }
+
+  template <typename Tag, typename Execution, typename F>
+  void scan_for_each(Execution const& policy, F& f) const {
+    auto threads = bimap_execution::thread_count(policy);
+    auto bounds = scan_bounds<Tag>(threads);
+    auto task = [&](std::size_t i) {
+      for (auto* ptr = bounds[i]; ptr != bounds[i + 1]; ptr = ptr->next()) {
+        visit_pair<Tag>(ptr, f);
+      }
+    };
+    bimap_execution::run_tasks(threads, bounds.size() - 1, task);
+  }
+
+  template <typename Tag, typename Execution, typename T, typename Reduce,
+            typename Transform>
+  T scan_reduce(Execution const& policy, T init, Reduce& reduce,
+                Transform& transform) const {
+    auto threads = bimap_execution::thread_count(policy);
+    auto bounds = scan_bounds<Tag>(threads);
+    std::vector<std::optional<T>> partial(bounds.size() - 1);
+    auto task = [&](std::size_t i) {
+      auto* ptr = bounds[i];
+      if (ptr == bounds[i + 1]) {
+        return;
+      }
+      T result = visit_pair<Tag>(ptr, transform);
+      for (ptr = ptr->next(); ptr != bounds[i + 1]; ptr = ptr->next()) {
+        result = reduce(std::move(result), visit_pair<Tag>(ptr, transform));
+      }
+      partial[i].emplace(std::move(result));
+    };
+    bimap_execution::run_tasks(threads, partial.size(), task);
+    for (auto& result : partial) {
+      if (result) {
+        init = reduce(std::move(init), std::move(*result));
+      }
+    }
+    return init;
+  }
+
+  template <typename Tag>
+  auto& cache_of() const {
+    if constexpr (std::is_same_v<Tag, LEFT_TAG>) {
+      return caches.left;
+    } else {
+      return caches.right;
+    }
+  }
+
+  template <typename Tag>
+  static std::size_t cache_slot(value_t<Tag> const& key) {
+    return std::hash<value_t<Tag>>()(key) & (cache_capacity - 1);
+  }
+
+  // find_ptr через lookup_cache, если он включен
+  template <typename Tag>
+  intrusive::set_element_base* find(value_t<Tag> const& key) const {
+    auto const& set = set_of<Tag>();
+    if constexpr (cache_capacity == 0) {
+      return set.find_ptr(key);
+    } else {
+      auto& cache = cache_of<Tag>();
+      auto& slot = cache.slots[cache_slot<Tag>(key)];
+      if (slot != nullptr && !set.less(key, value_of<Tag>(slot)) &&
+          !set.less(value_of<Tag>(slot), key)) {
+        cache.counters.hits++;
+        return slot;
+      }
+      cache.counters.misses++;
+      auto* ptr = set.find_ptr(key);
+      if (ptr != set.end_ptr()) {
+        // Слот по хранимому ключу, а не по искомому: компаратор может
+        // считать эквивалентными ключи с разным хешем, а forget чистит слот
+        // хранимого ключа. Такой запрос просто промахивается.
+        cache.slots[cache_slot<Tag>(value_of<Tag>(ptr))] = ptr;
+      }
+      return ptr;
+    }
+  }
+
+  // Убирает node из кэша, ключи node должны быть еще целы
+  void forget(node_t* node) const {
+    if constexpr (cache_capacity != 0) {
+      forget<LEFT_TAG>(node);
+      forget<RIGHT_TAG>(node);
+    }
+  }
+
+  template <typename Tag>
+  void forget(node_t* node) const {
+    auto& slot = cache_of<Tag>().slots[cache_slot<Tag>(value_of<Tag>(node))];
+    if (slot == to_base<Tag>(node)) {
+      slot = nullptr;
+    }
+  }
+
+  void clear_caches() {
+    if constexpr (cache_capacity != 0) {
+      caches.left.slots = {};
+      caches.right.slots = {};
+    }
+  }
+
+  // value как T: ссылка на него же или созданный из него временный T
+  template <typename T, typename U>
+  static decltype(auto) as_value(U&& value) {
+    if constexpr (std::is_same_v<std::remove_cvref_t<U>, T>) {
+      return std::forward<U>(value);
+    } else {
+      return T(std::forward<U>(value));
+    }
+  }
+
+  template <typename Tag, typename OtherTag, typename Key, typename... Args>
+  upsert_result<iterator_t<Tag>> emplace(Key&& key, Args&&... args) {
+    auto* position = set_of<Tag>().lower_bound(key);
+    if (contains<Tag>(position, key)) {
+      return {iterator_t<Tag>(position), bimap_upsert::found, false};
+    }
+    value_t<OtherTag> value(std::forward<Args>(args)...);
+    return upsert<Tag, OtherTag>(position, std::forward<Key>(key),
+                                 std::move(value));
+  }
+
+  // Ставит пару (key, value) по стороне Tag, position - lower_bound key
+  template <typename Tag, typename OtherTag, typename Key, typename Value>
+  upsert_result<iterator_t<Tag>> upsert(intrusive::set_element_base* position,
+                                        Key&& key, Value&& value) {
+    auto& set = set_of<Tag>();
+    auto& other_set = set_of<OtherTag>();
+    auto* other_position = other_set.lower_bound(value);
+    node_t* by_key = contains<Tag>(position, key) ? to_node<Tag>(position)
+                                                  : nullptr;
+    node_t* by_value = contains<OtherTag>(other_position, value)
+                           ? to_node<OtherTag>(other_position)
+                           : nullptr;
+
+    if (by_key != nullptr && by_key == by_value) {
+      return {iterator_t<Tag>(position), bimap_upsert::found, false};
+    }
+
+    if (by_key != nullptr) {
+      auto* element = to_base<OtherTag>(by_key);
+      if (by_value == nullptr && other_position == element) {
+        other_position = element->next();
+      }
+      other_set.unlink(element);
+      reassign<Tag, OtherTag>(by_key, std::forward<Value>(value));
+      if (by_value == nullptr) {
+        other_set.insert_before(value_element<OtherTag>(by_key),
+                                other_position);
+        return {iterator_t<Tag>(position), bimap_upsert::assigned, false};
+      }
+      // Узел by_value встает на место вытесненного без сравнений
+      other_set.replace(to_base<OtherTag>(by_value), element);
+      set.unlink(to_base<Tag>(by_value));
+      bimap_size--;
+      destroy_node(by_value);
+      return {iterator_t<Tag>(position), bimap_upsert::assigned, true};
+    }
+
+    if (by_value != nullptr) {
+      // Вытесняемая пара уже стоит на месте value в other_set, меняем ей ключ
+      auto* element = to_base<Tag>(by_value);
+      if (position == element) {
+        position = element->next();
+      }
+      set.unlink(element);
+      reassign<OtherTag, Tag>(by_value, std::forward<Key>(key));
+      set.insert_before(value_element<Tag>(by_value), position);
+      if constexpr (has_payload) {
+        // Узел достался новой паре, payload вытесненной ей не переходит
+        by_value->payload = payload_t();
+      }
+      return {iterator_t<Tag>(element), bimap_upsert::inserted, true};
+    }
+
+    node_t* node;
+    if constexpr (std::is_same_v<Tag, LEFT_TAG>) {
+      node = create_node(std::forward<Key>(key), std::forward<Value>(value));
+    } else {
+      node = create_node(std::forward<Value>(value), std::forward<Key>(key));
+    }
+    set.insert_before(value_element<Tag>(node), position);
+    other_set.insert_before(value_element<OtherTag>(node), other_position);
+    bimap_size++;
+    return {iterator_t<Tag>(to_base<Tag>(node)), bimap_upsert::inserted,
+            false};
+  }
+
+  template <typename Tag>
+  static element_t<Tag>& value_element(node_t* node) {
+    return static_cast<element_t<Tag>&>(*node);
+  }
+
+  // Присваивает значение стороны FieldTag узла, вынутого из ее дерева. Узел
+  // пока есть только в дереве стороны Tag, если присваивание бросает, пара
+  // удаляется.
+  template <typename Tag, typename FieldTag, typename Value>
+  void reassign(node_t* node, Value&& value) {
+    forget(node);
+    try {
+      value_element<FieldTag>(node).value = std::forward<Value>(value);
+      value_element<FieldTag>(node).refresh_cache();
+    } catch (...) {
+      set_of<Tag>().unlink(to_base<Tag>(node));
+      bimap_size--;
+      destroy_node(node);
+      throw;
+    }
+  }
+
+  static left_t& left_of(node_t* node) {
+    return static_cast<element_t<LEFT_TAG>&>(*node).value;
+  }
+
+  static right_t& right_of(node_t* node) {
+    return static_cast<element_t<RIGHT_TAG>&>(*node).value;
+  }
+
+  static bimap_conflict swapped(bimap_conflict policy) {
+    switch (policy) {
+    case bimap_conflict::keep_first:
+      return bimap_conflict::keep_second;
+    case bimap_conflict::keep_second:
+      return bimap_conflict::keep_first;
+    default:
+      return policy;
+    }
+  }
+
+  // Обходит узлы source по порядку left, f может вынуть текущий узел
+  template <typename F>
+  static void for_each_node(bimap const& source, F f) {
+    for (auto* ptr = source.left_set.begin_ptr();
+         ptr != source.left_set.end_ptr();) {
+      auto* node = to_node<LEFT_TAG>(ptr);
+      ptr = ptr->next();
+      f(node);
+    }
+  }
+
+  // Пары *this, совпадающие с парой node по left и по right. hint - позиция
+  // для lower_bound_from, узлы обходятся по возрастанию left.
+  std::pair<node_t*, node_t*> match(node_t* node,
+                                    intrusive::set_element_base*& hint) const {
+    auto* ptr = left_set.lower_bound_from(left_of(node), hint);
+    hint = before(ptr);
+    auto* by_right = right_set.find_ptr(right_of(node));
+    return {contains<LEFT_TAG>(ptr, left_of(node)) ? to_node<LEFT_TAG>(ptr)
+                                              : nullptr,
+            by_right != right_set.end_ptr() ? to_node<RIGHT_TAG>(by_right)
+                                            : nullptr};
+  }
+
+  // Добавляет к result пары other. Позиция вставки по left уже найдена
+  // поиском, поэтому узел встает перед ней без повторного спуска.
+  template <typename Other>
+  static bimap merge(bimap result, Other&& other, bimap_conflict policy) {
+    std::vector<node_t*> dropped;
+    auto* hint = result.left_set.end_ptr();
+    for_each_node(other, [&](node_t* node) {
+      auto [by_left, by_right] = result.match(node, hint);
+      if (by_left != nullptr && by_left == by_right) {
+        return;
+      }
+      if (by_left != nullptr || by_right != nullptr) {
+        if (policy == bimap_conflict::keep_first) {
+          return;
+        }
+        if (policy == bimap_conflict::drop) {
+          // Удаляем после обхода: с этими парами могут конфликтовать и
+          // следующие пары other
+          for (auto* ptr : {by_left, by_right}) {
+            if (ptr != nullptr) {
+              dropped.push_back(ptr);
+            }
+          }
+          return;
+        }
+        if (hint == to_base<LEFT_TAG>(by_right)) {
+          hint = result.before(hint);
+        }
+        for (auto* ptr : {by_left, by_right}) {
+          if (ptr != nullptr) {
+            result.remove_node(ptr);
+          }
+        }
+      }
+      auto* position = result.left_set.lower_bound_from(left_of(node), hint);
+      auto* added = result.take_node(std::forward<Other>(other), node);
+      result.link(added, position);
+      hint = to_base<LEFT_TAG>(added);
+    });
+    result.remove_all(dropped);
+    return result;
+  }
+
+  // Оставляет в result пары, совпадающие с парой other; при keep_conflicts
+  // также пары, конфликтующие с ней.
+  static bimap keep_matched(bimap result, bimap const& other,
+                            bool keep_conflicts) {
+    for_each_node(result, [&, hint = other.left_set.end_ptr()](
+                              node_t* node) mutable {
+      auto [by_left, by_right] = other.match(node, hint);
+      bool same = by_left != nullptr && by_left == by_right;
+      bool conflict = !same && (by_left != nullptr || by_right != nullptr);
+      if (!same && !(conflict && keep_conflicts)) {
+        result.remove_node(node);
+      }
+    });
+    return result;
+  }
+
+  // Собирает из source пары, совпадающие или конфликтующие с парами other.
+  template <typename Source>
+  static bimap pick_matched(Source&& source, bimap const& other) {
+    std::vector<node_t*> picked;
+    for_each_node(other, [&, hint = source.left_set.end_ptr()](
+                             node_t* node) mutable {
+      auto [by_left, by_right] = source.match(node, hint);
+      for (auto* ptr : {by_left, by_right}) {
+        if (ptr != nullptr) {
+          picked.push_back(ptr);
+        }
+      }
+    });
+    std::sort(picked.begin(), picked.end(), [&](node_t* a, node_t* b) {
+      return source.left_set.less(left_of(a), left_of(b));
+    });
+    picked.erase(std::unique(picked.begin(), picked.end()), picked.end());
+
+    bimap result(static_cast<CompareLeft const&>(source.left_set),
+                 static_cast<CompareRight const&>(source.right_set));
+    for (auto* node : picked) {
+      // Узлы приходят по возрастанию left, поэтому встают в конец
+      result.link(result.take_node(std::forward<Source>(source), node),
+                  result.left_set.end_ptr());
+    }
+    return result;
+  }
+
+  // Узел для *this с парой node из source: забирает его, если source -
+  // rvalue, иначе копирует.
+  template <typename Source>
+  node_t* take_node(Source&& source, node_t* node) {
+    if constexpr (std::is_same_v<Source, bimap>) {
+      source.forget(node);
+      auto* result = node;
+      if (source.owns_storage(node)) {
+        result = create_node(std::move(left_of(node)),
+                             std::move(right_of(node)),
+                             std::move(node->payload));
+      }
+      source.remove_links(node);
+      if (result != node) {
+        source.destroy_node(node);
+      }
+      return result;
+    } else {
+      return create_node(left_of(node), right_of(node), node->payload);
+    }
+  }
+
+  // Вставляет узел, position - lower_bound его left
+  void link(node_t* node, intrusive::set_element_base* position) {
+    right_set.insert(static_cast<element_t<RIGHT_TAG>&>(*node));
+    left_set.insert_before(static_cast<element_t<LEFT_TAG>&>(*node), position);
+    bimap_size++;
+  }
+
+  // Удаляет узлы, каждый может встречаться несколько раз
+  void remove_all(std::vector<node_t*>& nodes) {
+    std::sort(nodes.begin(), nodes.end(), std::less<node_t*>());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    for (auto* node : nodes) {
+      remove_node(node);
+    }
+  }
+
+  // ptr - результат lower_bound по стороне Tag
+  template <typename Tag, typename T>
+  bool contains(intrusive::set_element_base* ptr, T const& value) const {
+    auto const& set = set_of<Tag>();
+    return ptr != set.end_ptr() &&
+           !set.less(value, static_cast<element_t<Tag>&>(*ptr).value);
+  }
+
+  // Позиция перед ptr для lower_bound_from, end_ptr() если ее нет. Как
+  // prev(), но подъем от первого узла останавливается на end_ptr(), так что
+  // begin_ptr() с его спуском к минимуму не нужен
+  intrusive::set_element_base* before(intrusive::set_element_base* ptr) const {
+    auto* end = left_set.end_ptr();
+    if (ptr->left != nullptr) {
+      return ptr->left->get_max_node_ptr();
+    }
+    while (ptr != end && ptr->parent->left == ptr) {
+      ptr = ptr->parent;
+    }
+    return ptr == end ? end : ptr->parent;
+  }
+
   void remove(left_iterator it) {
+    remove_node(it.get_ptr_node_t());
+  }
+
+  void remove_node(node_t* ptr_node) {
+    remove_links(ptr_node);
+    destroy_node(ptr_node);
+  }
+
+  // Вынимает узел из обоих деревьев, не удаляя его
+  void remove_links(node_t* ptr_node) {
     bimap_size--;
+    left_set.unlink(to_base<LEFT_TAG>(ptr_node));
+    right_set.unlink(to_base<RIGHT_TAG>(ptr_node));
+  }
+
+  // Число значащих бит n, как std::bit_width
+  static std::size_t bit_width(std::size_t n) {
+    std::size_t width = 0;
+    for (; n != 0; n >>= 1) {
+      width++;
+    }
+    return width;
+  }
+
+  template <typename Tag, typename OtherTag, typename Set, typename OtherSet>
+  void erase_range(Set& set, OtherSet& other_set,
+                   intrusive::set_element_base* first,
+                   intrusive::set_element_base* last) {
+    if (first == last) {
+      return;
+    }
+    auto* middle = set.extract(first, last);
+
+    std::size_t count = 0;
+    for (auto* ptr = middle->get_min_node_ptr(); ptr; ptr = ptr->next()) {
+      count++;
+    }
+
+    if (count * bit_width(bimap_size) >= bimap_size) {
+      // Высоты 0 в дереве не бывает, ею помечены удаляемые элементы
+      for (auto* ptr = middle->get_min_node_ptr(); ptr; ptr = ptr->next()) {
+        to_base<OtherTag>(to_node<Tag>(ptr))->height = 0;
+      }
+      other_set.rebuild_without(
+          [](intrusive::set_element_base* ptr) { return ptr->height == 0; });
+    } else {
+      for (auto* ptr = middle->get_min_node_ptr(); ptr; ptr = ptr->next()) {
+        other_set.unlink(to_base<OtherTag>(to_node<Tag>(ptr)));
+      }
+    }
 
-    auto* ptr_node = it.get_ptr_node_t();
+    destroy_subtree<Tag>(middle);
+    bimap_size -= count;
+  }
 
-    auto& left_value = *it;
-    auto& right_value = *it.flip();
+  // Вынимает узлы из обоих деревьев и разрушает их
+  void erase_nodes(std::vector<node_t*> const& nodes) noexcept {
+    if (nodes.empty()) {
+      return;
+    }
+    if (nodes.size() * bit_width(bimap_size) >= bimap_size) {
+      for (auto* node : nodes) {
+        to_base<LEFT_TAG>(node)->height = 0;
+        to_base<RIGHT_TAG>(node)->height = 0;
+      }
+      auto erased = [](intrusive::set_element_base* ptr) {
+        return ptr->height == 0;
+      };
+      left_set.rebuild_without(erased);
+      right_set.rebuild_without(erased);
+    } else {
+      for (auto* node : nodes) {
+        left_set.unlink(to_base<LEFT_TAG>(node));
+        right_set.unlink(to_base<RIGHT_TAG>(node));
+      }
+    }
+    for (auto* node : nodes) {
+      destroy_node(node);
+    }
+    bimap_size -= nodes.size();
+  }
 
-    left_set.erase(left_value);
-    right_set.erase(right_value);
+  template <typename Tag>
+  void destroy_subtree(intrusive::set_element_base* root) {
+    if (root == nullptr) {
+      return;
+    }
+    destroy_subtree<Tag>(root->left);
+    destroy_subtree<Tag>(root->right);
+    destroy_node(to_node<Tag>(root));
+  }
 
-    delete ptr_node;
+  // Число единиц в младших битах подряд, как std::countr_one
+  static std::size_t countr_one(std::uint64_t bits) {
+#if defined(__GNUC__)
+    return ~bits == 0 ? 64 : __builtin_ctzll(~bits);
+#else
+    std::size_t count = 0;
+    for (; bits & 1; bits >>= 1) {
+      count++;
+    }
+    return count;
+#endif
+  }
+
+  template <typename... Args>
+  node_t* create_node(Args&&... args) {
+    if constexpr (inline_capacity != 0) {
+      std::size_t index = countr_one(inline_storage.used);
+      if (index < inline_capacity) {
+        auto* ptr = ::new (inline_storage.slot(index))
+            node_t(std::forward<Args>(args)...);
+        inline_storage.used |= std::uint64_t(1) << index;
+        return ptr;
+      }
+    }
+    void* memory;
+    if constexpr (slab_storage) {
+      memory = take_slot();
+    } else {
+      memory = std::allocator<node_t>().allocate(1);
+    }
+    node_t* ptr;
+    try {
+      ptr = ::new (memory) node_t(std::forward<Args>(args)...);
+    } catch (...) {
+      if constexpr (slab_storage) {
+        put_slot(memory);
+      } else {
+        std::allocator<node_t>().deallocate(static_cast<node_t*>(memory), 1);
+      }
+      throw;
+    }
+    if constexpr (collect_stats && !slab_storage) {
+      node_counters.allocations++;
+    }
+    return ptr;
+  }
+
+  template <bool Enabled = slab_storage, std::enable_if_t<Enabled, int> = 0>
+  void* take_slot() {
+    if (free_slots.head != nullptr) {
+      free_slots.count--;
+      return std::exchange(free_slots.head, free_slots.head->next);
+    }
+    if (block == nullptr || block->live == block->capacity) {
+      add_block(std::max(bimap_size, min_slab_block));
+    }
+    return block->slots() + block->live++;
+  }
+
+  template <bool Enabled = slab_storage, std::enable_if_t<Enabled, int> = 0>
+  void put_slot(void* memory) noexcept {
+    free_slots.head = ::new (memory) free_slot{free_slots.head};
+    free_slots.count++;
+  }
+
+  // Делает новый блок на capacity узлов текущим, невыданные места прежнего
+  // текущего блока уходят в free_slots
+  template <bool Enabled = slab_storage, std::enable_if_t<Enabled, int> = 0>
+  void add_block(std::size_t capacity) {
+    auto* fresh = node_block::allocate(capacity);
+    if constexpr (collect_stats) {
+      node_counters.allocations++;
+    }
+    if (block != nullptr) {
+      while (block->live != block->capacity) {
+        put_slot(block->slots() + block->live++);
+      }
+    }
+    fresh->next = block;
+    block = fresh;
+  }
+
+  // Возвращает память всех блоков slab_storage, узлов в них уже нет
+  template <bool Enabled = slab_storage, std::enable_if_t<Enabled, int> = 0>
+  void release_blocks() noexcept {
+    while (block != nullptr) {
+      node_block::deallocate(std::exchange(block, block->next));
+      if constexpr (collect_stats) {
+        node_counters.deallocations++;
+      }
+    }
+    free_slots = {};
+  }
+
+  void destroy_node(node_t* ptr) {
+    forget(ptr);
+    ptr->~node_t();
+    release(ptr);
+  }
+
+  // Память узла принадлежит самому bimap (встроенный буфер, блоки slab или
+  // compact) и умрет вместе с ним, такой узел нельзя отдать другому bimap
+  bool owns_storage(node_t const* ptr) const noexcept {
+    if constexpr (inline_capacity != 0) {
+      if (inline_storage.index_of(ptr) < inline_capacity) {
+        return true;
+      }
+    }
+    return slab_storage || (block != nullptr && block->owns(ptr));
+  }
+
+  // Освобождает память уже разрушенного узла
+  void release(node_t* ptr) noexcept {
+    if constexpr (inline_capacity != 0) {
+      std::size_t index = inline_storage.index_of(ptr);
+      if (index < inline_capacity) {
+        inline_storage.used &= ~(std::uint64_t(1) << index);
+        return;
+      }
+    }
+    if constexpr (slab_storage) {
+      put_slot(ptr);
+    } else {
+      if (block != nullptr && block->owns(ptr)) {
+        if (--block->live != 0) {
+          return;
+        }
+        node_block::deallocate(std::exchange(block, nullptr));
+      } else {
+        std::allocator<node_t>().deallocate(ptr, 1);
+      }
+      if constexpr (collect_stats) {
+        node_counters.deallocations++;
+      }
+    }
+  }
+
+  // Переносит узел в сырую память `to`, сохраняя его места в обоих деревьях
+  // `owner`
+  static node_t* relocate(bimap& owner, node_t* from, void* to) noexcept {
+    auto* ptr = ::new (to)
+        node_t(std::move(static_cast<element_t<LEFT_TAG>&>(*from).value),
+               std::move(static_cast<element_t<RIGHT_TAG>&>(*from).value),
+               std::move(from->payload));
+    owner.left_set.replace(to_base<LEFT_TAG>(from), to_base<LEFT_TAG>(ptr));
+    owner.right_set.replace(to_base<RIGHT_TAG>(from), to_base<RIGHT_TAG>(ptr));
+    from->~node_t();
+    return ptr;
+  }
+
+  // Меняет местами деревья и размеры, компараторы остаются на месте
+  void swap_contents(bimap& other) noexcept {
+    if (this == &other) {
+      return;
+    }
+    // Узлы переходят в другой bimap, а встроенные еще и переезжают
+    clear_caches();
+    other.clear_caches();
+    if constexpr (inline_capacity != 0) {
+      exchange_inline_nodes(other);
+    }
+
+    left_set.swap_tree(other.left_set);
+    right_set.swap_tree(other.right_set);
+
+    std::swap(block, other.block);
+    std::swap(free_slots, other.free_slots);
+    std::swap(bimap_size, other.bimap_size);
+  }
+
+  // Меняет местами содержимое встроенных буферов, узлы остаются в своих
+  // деревьях
+  void exchange_inline_nodes(bimap& other) noexcept {
+    if constexpr (inline_capacity != 0) {
+      auto& mine = inline_storage;
+      auto& theirs = other.inline_storage;
+      for (std::size_t i = 0; i < inline_capacity; i++) {
+        bool in_mine = mine.used >> i & 1;
+        bool in_theirs = theirs.used >> i & 1;
+        if (in_mine && in_theirs) {
+          alignas(node_t) std::byte tmp[sizeof(node_t)];
+          auto* moved = relocate(*this, mine.node(i), tmp);
+          relocate(other, theirs.node(i), mine.slot(i));
+          relocate(*this, moved, theirs.slot(i));
+        } else if (in_mine) {
+          relocate(*this, mine.node(i), theirs.slot(i));
+        } else if (in_theirs) {
+          relocate(other, theirs.node(i), mine.slot(i));
+        }
+      }
+      std::swap(mine.used, theirs.used);
+    }
   }
 
   template <class left_type = left_t, class right_type = right_t>
@@ -404,13 +2103,11 @@ private:
       return end_left();
     }
 
-    node_t* pointer = new node_t(std::forward<left_type>(left),
-                                 std::forward<right_type>(right));
+    node_t* pointer = create_node(std::forward<left_type>(left),
+                                  std::forward<right_type>(right));
 
-    auto& l_node =
-        static_cast<intrusive::set_element<Left, LEFT_TAG>&>(*pointer);
-    auto& r_node =
-        static_cast<intrusive::set_element<Right, RIGHT_TAG>&>(*pointer);
+    auto& l_node = static_cast<element_t<LEFT_TAG>&>(*pointer);
+    auto& r_node = static_cast<element_t<RIGHT_TAG>&>(*pointer);
 
     right_set.insert(r_node);
     left_set.insert(l_node);
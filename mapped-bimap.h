@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "serializer.h"
+#include "sorted-bimap.h"
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define BIMAP_HAS_MMAP 1
+#endif
+
+// Read-only bimap поверх готового образа в памяти (например, mmap файла).
+// Образ не содержит указателей: обе стороны лежат отсортированными
+// массивами, связь между парами задается индексами, поэтому открытие
+// работает за O(1) и страницы образа разделяются между процессами.
+//
+// Формат пишется mapped_bimap::write из обычного bimap. Компараторы при
+// чтении должны совпадать с компараторами bimap, из которого записан образ.
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+class mapped_bimap
+    : public sorted_bimap<mapped_bimap<Left, Right, CompareLeft, CompareRight>,
+                          Left, Right, CompareLeft, CompareRight> {
+  using base = sorted_bimap<mapped_bimap, Left, Right, CompareLeft,
+                            CompareRight>;
+  friend base;
+
+  static_assert(std::is_trivially_copyable_v<Left> &&
+                    std::is_trivially_copyable_v<Right>,
+                "mapped_bimap stores values as raw bytes");
+
+  using index_t = std::uint32_t;
+
+  struct header {
+    std::uint64_t magic;
+    std::uint64_t count;
+    std::uint64_t left_size;
+    std::uint64_t right_size;
+    std::uint64_t lefts_offset;          // Left[count] по возрастанию left
+    std::uint64_t rights_offset;         // Right[count] по возрастанию right
+    std::uint64_t left_to_right_offset;  // index_t[count]
+    std::uint64_t right_to_left_offset;  // index_t[count]
+  };
+
+  static constexpr std::uint64_t magic = 0x4249'4d41'504d'3031ULL;
+
+public:
+  // Записывает образ bimap. Пары нумеруются в порядке left, для каждой
+  // стороны сохраняется индекс пары в другой стороне.
+  template <typename Bimap>
+  static void write(std::ostream& out, Bimap const& map) {
+    if (map.size() > std::numeric_limits<index_t>::max()) {
+      throw std::length_error("mapped_bimap: too many pairs");
+    }
+    std::size_t count = map.size();
+
+    std::unordered_map<Left const*, index_t> left_index;
+    left_index.reserve(count);
+    for (auto it = map.begin_left(); it != map.end_left(); ++it) {
+      left_index.emplace(&*it, static_cast<index_t>(left_index.size()));
+    }
+    std::vector<index_t> left_to_right(count), right_to_left(count);
+    index_t position = 0;
+    for (auto it = map.begin_right(); it != map.end_right(); ++it) {
+      right_to_left[position] = left_index.find(&*it.flip())->second;
+      left_to_right[right_to_left[position]] = position;
+      position++;
+    }
+
+    header head{};
+    head.magic = magic;
+    head.count = count;
+    head.left_size = sizeof(Left);
+    head.right_size = sizeof(Right);
+    std::uint64_t offset = sizeof(header);
+    auto reserve = [&](std::size_t alignment, std::size_t size) {
+      offset = (offset + alignment - 1) / alignment * alignment;
+      auto result = offset;
+      offset += size * count;
+      return result;
+    };
+    head.lefts_offset = reserve(alignof(Left), sizeof(Left));
+    head.rights_offset = reserve(alignof(Right), sizeof(Right));
+    head.left_to_right_offset = reserve(alignof(index_t), sizeof(index_t));
+    head.right_to_left_offset = reserve(alignof(index_t), sizeof(index_t));
+
+    std::uint64_t written = 0;
+    auto put = [&](void const* data, std::size_t size) {
+      serialization::write_bytes(out, data, size);
+      written += size;
+    };
+    auto pad_to = [&](std::uint64_t at) {
+      for (char zero = 0; written < at;) {
+        put(&zero, 1);
+      }
+    };
+    put(&head, sizeof(head));
+    pad_to(head.lefts_offset);
+    for (auto it = map.begin_left(); it != map.end_left(); ++it) {
+      put(&*it, sizeof(Left));
+    }
+    pad_to(head.rights_offset);
+    for (auto it = map.begin_right(); it != map.end_right(); ++it) {
+      put(&*it, sizeof(Right));
+    }
+    pad_to(head.left_to_right_offset);
+    put(left_to_right.data(), count * sizeof(index_t));
+    pad_to(head.right_to_left_offset);
+    put(right_to_left.data(), count * sizeof(index_t));
+  }
+
+  // Образ должен быть выровнен по alignof(std::max_align_t) и жить дольше
+  // mapped_bimap. Бросает std::runtime_error, если заголовок чужой или
+  // массивы не помещаются в size. Содержимое массивов не проверяется, иначе
+  // открытие стало бы O(n): образ с испорченными индексами ведет к чтению
+  // за его пределами, поэтому открывать можно только образы от write.
+  mapped_bimap(void const* data, std::size_t size,
+               CompareLeft compare_left = CompareLeft(),
+               CompareRight compare_right = CompareRight())
+      : base(std::move(compare_left), std::move(compare_right)) {
+    attach(data, size);
+  }
+
+#ifdef BIMAP_HAS_MMAP
+  // Отображает файл в память только для чтения, отображение живет пока
+  // жива любая копия mapped_bimap.
+  static mapped_bimap open(char const* path,
+                           CompareLeft compare_left = CompareLeft(),
+                           CompareRight compare_right = CompareRight()) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("mapped_bimap: can't open file");
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || info.st_size == 0) {
+      ::close(fd);
+      throw std::runtime_error("mapped_bimap: can't map file");
+    }
+    std::size_t size = info.st_size;
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("mapped_bimap: can't map file");
+    }
+    std::shared_ptr<void const> mapping(data, [size](void const* ptr) {
+      ::munmap(const_cast<void*>(ptr), size);
+    });
+
+    mapped_bimap result(data, size, std::move(compare_left),
+                        std::move(compare_right));
+    result.mapping = std::move(mapping);
+    return result;
+  }
+#endif
+
+  std::size_t size() const {
+    return count;
+  }
+
+private:
+  void attach(void const* data, std::size_t size) {
+    auto const* bytes = static_cast<unsigned char const*>(data);
+    if (reinterpret_cast<std::uintptr_t>(bytes) % alignof(std::max_align_t) !=
+        0) {
+      throw std::runtime_error("mapped_bimap: image is not aligned");
+    }
+    if (size < sizeof(header)) {
+      throw std::runtime_error("mapped_bimap: bad image");
+    }
+    auto const& head = *reinterpret_cast<header const*>(bytes);
+    if (head.magic != magic || head.left_size != sizeof(Left) ||
+        head.right_size != sizeof(Right) ||
+        head.count > std::numeric_limits<index_t>::max()) {
+      throw std::runtime_error("mapped_bimap: bad image");
+    }
+    auto array = [&](std::uint64_t offset, std::size_t element_size,
+                     std::size_t alignment) {
+      if (offset % alignment != 0 || offset > size ||
+          (size - offset) / element_size < head.count) {
+        throw std::runtime_error("mapped_bimap: bad image");
+      }
+      return bytes + offset;
+    };
+    count = head.count;
+    lefts = reinterpret_cast<Left const*>(
+        array(head.lefts_offset, sizeof(Left), alignof(Left)));
+    rights = reinterpret_cast<Right const*>(
+        array(head.rights_offset, sizeof(Right), alignof(Right)));
+    left_to_right = reinterpret_cast<index_t const*>(array(
+        head.left_to_right_offset, sizeof(index_t), alignof(index_t)));
+    right_to_left = reinterpret_cast<index_t const*>(array(
+        head.right_to_left_offset, sizeof(index_t), alignof(index_t)));
+  }
+
+  template <bool IsLeft>
+  auto const* values() const {
+    if constexpr (IsLeft) {
+      return lefts;
+    } else {
+      return rights;
+    }
+  }
+
+  template <bool IsLeft>
+  index_t const* paired() const {
+    return IsLeft ? left_to_right : right_to_left;
+  }
+
+  std::shared_ptr<void const> mapping;
+  std::size_t count = 0;
+  Left const* lefts = nullptr;
+  Right const* rights = nullptr;
+  index_t const* left_to_right = nullptr;
+  index_t const* right_to_left = nullptr;
+};
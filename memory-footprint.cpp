@@ -0,0 +1,254 @@
+// Замер памяти: байты на пару, аллокации на операцию и пиковая память
+// bimap в сравнении с парой std::map. Все аллокации процесса считаются
+// через замену глобальных operator new/delete.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "bimap.h"
+#include "test-classes.h"
+
+namespace {
+
+struct allocation_counters {
+  std::size_t allocations = 0;
+  std::size_t deallocations = 0;
+  std::size_t live_bytes = 0;
+  std::size_t peak_bytes = 0;
+};
+
+allocation_counters counters;
+
+// Размер блока хранится перед ним, чтобы считать и delete без размера
+constexpr std::size_t header_size = alignof(std::max_align_t);
+
+void* counted_allocate(std::size_t size) noexcept {
+  auto* memory = static_cast<std::byte*>(std::malloc(size + header_size));
+  if (memory == nullptr) {
+    return nullptr;
+  }
+  *reinterpret_cast<std::size_t*>(memory) = size;
+  counters.allocations++;
+  counters.live_bytes += size;
+  counters.peak_bytes = std::max(counters.peak_bytes, counters.live_bytes);
+  return memory + header_size;
+}
+
+void counted_deallocate(void* ptr) noexcept {
+  if (ptr == nullptr) {
+    return;
+  }
+  auto* memory = static_cast<std::byte*>(ptr) - header_size;
+  counters.deallocations++;
+  counters.live_bytes -= *reinterpret_cast<std::size_t*>(memory);
+  std::free(memory);
+}
+
+} // namespace
+
+void* operator new(std::size_t size) {
+  if (void* ptr = counted_allocate(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+  return counted_allocate(size);
+}
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept {
+  return counted_allocate(size);
+}
+void operator delete(void* ptr) noexcept {
+  counted_deallocate(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+  counted_deallocate(ptr);
+}
+void operator delete(void* ptr, std::size_t) noexcept {
+  counted_deallocate(ptr);
+}
+void operator delete[](void* ptr, std::size_t) noexcept {
+  counted_deallocate(ptr);
+}
+
+namespace {
+
+template <typename T>
+T make_value(std::size_t i) {
+  if constexpr (std::is_same_v<T, int>) {
+    return static_cast<int>(i);
+  } else if constexpr (std::is_same_v<T, std::string>) {
+    // Длиннее буфера малой строки, чтобы строки аллоцировали
+    auto digits = std::to_string(i);
+    return std::string(24 - digits.size(), '0') + digits;
+  } else {
+    return T(static_cast<int>(i));
+  }
+}
+
+template <typename Left, typename Right>
+struct bimap_container {
+  static constexpr char const* name = "bimap";
+
+  bimap<Left, Right> map;
+
+  void insert(std::size_t left, std::size_t right) {
+    map.insert(make_value<Left>(left), make_value<Right>(right));
+  }
+  void erase(Left const& left) {
+    map.erase_left(left);
+  }
+  bool find(Right const& right) const {
+    return map.find_right(right) != map.end_right();
+  }
+  // Вызывается после вставки всех пар, до замера памяти
+  void after_build() {}
+};
+
+template <typename Left, typename Right>
+struct compacted_bimap_container : bimap_container<Left, Right> {
+  static constexpr char const* name = "bimap+compact";
+
+  void after_build() {
+    this->map.compact();
+  }
+};
+
+template <typename Left, typename Right>
+struct two_maps_container {
+  static constexpr char const* name = "2 x std::map";
+
+  std::map<Left, Right> left_to_right;
+  std::map<Right, Left> right_to_left;
+
+  // Пары в замере не конфликтуют, поэтому проверки на конфликт нет
+  void insert(std::size_t left, std::size_t right) {
+    left_to_right.emplace(make_value<Left>(left), make_value<Right>(right));
+    right_to_left.emplace(make_value<Right>(right), make_value<Left>(left));
+  }
+  void erase(Left const& left) {
+    auto it = left_to_right.find(left);
+    if (it != left_to_right.end()) {
+      right_to_left.erase(it->second);
+      left_to_right.erase(it);
+    }
+  }
+  bool find(Right const& right) const {
+    return right_to_left.find(right) != right_to_left.end();
+  }
+  void after_build() {}
+};
+
+struct report {
+  double bytes_per_pair;
+  double allocations_per_insert;
+  double allocations_per_erase;
+  double allocations_per_find;
+  std::size_t peak_bytes;
+};
+
+template <typename Container, typename Left, typename Right>
+report measure(std::size_t size) {
+  // Ключи для поиска и удаления готовятся заранее и не попадают в замер.
+  // Вставляемые значения создаются при вставке: контейнер все равно
+  // хранит свою копию, так что их аллокации честно относятся к нему.
+  std::vector<std::size_t> order(size * 2);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(size));
+  std::vector<Left> lefts;
+  std::vector<Right> rights;
+  lefts.reserve(order.size());
+  rights.reserve(order.size());
+  for (std::size_t i = 0; i < order.size(); i++) {
+    lefts.push_back(make_value<Left>(order[i]));
+    rights.push_back(make_value<Right>(i));
+  }
+
+  report result{};
+  auto start = counters;
+  counters.peak_bytes = counters.live_bytes;
+  {
+    Container container;
+    for (std::size_t i = 0; i < size; i++) {
+      container.insert(order[i], i);
+    }
+    container.after_build();
+    result.bytes_per_pair =
+        double(counters.live_bytes - start.live_bytes) / size;
+    result.allocations_per_insert =
+        double(counters.allocations - start.allocations) / size;
+
+    auto before_erase = counters;
+    for (std::size_t i = 0; i < size; i++) {
+      container.erase(lefts[i]);
+      container.insert(order[size + i], size + i);
+    }
+    result.allocations_per_erase =
+        double(counters.deallocations - before_erase.deallocations) / size;
+
+    auto before_find = counters;
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < size * 2; i++) {
+      found += container.find(rights[i]);
+    }
+    result.allocations_per_find =
+        double(counters.allocations - before_find.allocations) / (size * 2);
+    if (found != size) {
+      std::fprintf(stderr, "unexpected number of pairs: %zu\n", found);
+      std::exit(1);
+    }
+  }
+  result.peak_bytes = counters.peak_bytes - start.live_bytes;
+  counters.peak_bytes = std::max(counters.peak_bytes, start.peak_bytes);
+  return result;
+}
+
+template <template <typename, typename> typename Container, typename Left,
+          typename Right>
+void print_row(char const* type_name, std::size_t size) {
+  auto result = measure<Container<Left, Right>, Left, Right>(size);
+  std::printf("%-32s %8zu %-14s %10.1f %10.2f %10.2f %10.2f %12zu\n",
+              type_name, size, Container<Left, Right>::name,
+              result.bytes_per_pair, result.allocations_per_insert,
+              result.allocations_per_erase, result.allocations_per_find,
+              result.peak_bytes);
+}
+
+template <typename Left, typename Right>
+void print_type(char const* type_name) {
+  for (std::size_t size : {1'000, 10'000, 100'000}) {
+    print_row<bimap_container, Left, Right>(type_name, size);
+    if constexpr (std::is_nothrow_move_constructible_v<Left> &&
+                  std::is_nothrow_move_constructible_v<Right>) {
+      print_row<compacted_bimap_container, Left, Right>(type_name, size);
+    }
+    print_row<two_maps_container, Left, Right>(type_name, size);
+  }
+}
+
+} // namespace
+
+int main() {
+  std::printf("%-32s %8s %-14s %10s %10s %10s %10s %12s\n", "types", "pairs",
+              "container", "bytes/pair", "alloc/ins", "free/erase",
+              "alloc/find", "peak bytes");
+  print_type<int, int>("int, int");
+  print_type<std::string, std::string>("string, string");
+  print_type<test_object, test_object>("test_object, test_object");
+  print_type<non_default_constructible, int>("non_default_constructible, int");
+  print_type<address_checking_object, address_checking_object>(
+      "address_checking_object x 2");
+  address_checking_object::expect_no_instances();
+}
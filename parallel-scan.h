@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Политики выполнения обходов bimap (for_each_left, reduce_left, ...):
+//   b.for_each_left(bimap_execution::par, f);
+//   b.for_each_left(bimap_execution::parallel_policy{8}, f);
+namespace bimap_execution {
+
+struct sequenced_policy {};
+
+// threads == 0 - по числу ядер (std::thread::hardware_concurrency)
+struct parallel_policy {
+  std::size_t threads = 0;
+};
+
+inline constexpr sequenced_policy seq{};
+inline constexpr parallel_policy par{};
+
+// Меньшие bimap обходятся в вызывающем потоке: запуск потоков дороже
+inline constexpr std::size_t min_parallel_size = std::size_t(1) << 14;
+
+// Сколько задач приходится на поток: задачи по поддеревьям неравны, мелкое
+// деление выравнивает нагрузку
+inline constexpr std::size_t tasks_per_thread = 8;
+
+inline std::size_t thread_count(sequenced_policy) {
+  return 1;
+}
+
+inline std::size_t thread_count(parallel_policy policy) {
+  if (policy.threads != 0) {
+    return policy.threads;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Выполняет task(i) для всех i из [0, count) на `threads` потоках, один из
+// которых вызывающий. Свободный поток берет следующий номер из общего
+// счетчика, так что медленная задача не задерживает остальные. Если поток
+// не удалось запустить, задачи разбирают уже запущенные. Первое исключение
+// из task пробрасывается, когда все потоки остановятся, после него новые
+// задачи не начинаются.
+template <typename Task>
+void run_tasks(std::size_t threads, std::size_t count, Task& task) {
+  std::atomic<std::size_t> next{0};
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  auto work = [&] {
+    while (!failed.load(std::memory_order_relaxed)) {
+      auto index = next.fetch_add(1, std::memory_order_relaxed);
+      if (index >= count) {
+        return;
+      }
+      try {
+        task(index);
+      } catch (...) {
+        std::lock_guard lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        failed.store(true, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  threads = std::min(threads, count);
+  try {
+    workers.reserve(threads == 0 ? 0 : threads - 1);
+    while (workers.size() + 1 < threads) {
+      workers.emplace_back(work);
+    }
+  } catch (...) {
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+} // namespace bimap_execution
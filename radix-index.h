@@ -0,0 +1,622 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace intrusive {
+
+// Ключи, которые radix_index умеет упорядочивать: целые с std::less.
+template <typename T, typename Compare>
+inline constexpr bool radix_indexable_v =
+    std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+    (std::is_same_v<Compare, std::less<T>> ||
+     std::is_same_v<Compare, std::less<>>);
+
+// Adaptive radix tree (Leis et al., ICDE 2013) над элементами множества с
+// уникальными целыми ключами - вторичный индекс рядом с AVL-деревом. Ключи
+// делятся на big-endian байты, поэтому поиск читает не больше sizeof(T)
+// небольших внутренних узлов и сам элемент вместо O(log n) элементов.
+// Внутренние узлы растут и сжимаются между 4, 16, 48 и 256 детьми, а цепочки
+// узлов с одним ребенком сжаты в префикс, хранящийся в узле.
+//
+// Поддержка индекса никогда не бросает: если внутренний узел не удалось
+// выделить, индекс сбрасывается и выключается до clear(), и владелец
+// возвращается к дереву.
+template <typename T, typename Element>
+class radix_index {
+  static_assert(alignof(Element) >= 2, "the low bit tags element pointers");
+
+  using key_type = std::make_unsigned_t<T>;
+  static constexpr std::size_t key_size = sizeof(T);
+
+  // Внутренний узел или элемент с установленным младшим битом, 0 - пусто
+  using child_t = std::uintptr_t;
+
+  enum class kind : std::uint8_t { node4, node16, node48, node256 };
+
+  struct inner {
+    explicit inner(kind type) : type(type) {}
+
+    kind type;
+    std::uint8_t prefix_length = 0;
+    std::uint16_t count = 0;
+    std::uint8_t prefix[key_size] = {};
+  };
+
+  // Ключи отсортированы
+  struct node4 : inner {
+    node4() : inner(kind::node4) {}
+
+    std::uint8_t keys[4] = {};
+    child_t children[4] = {};
+  };
+
+  struct node16 : inner {
+    node16() : inner(kind::node16) {}
+
+    std::uint8_t keys[16] = {};
+    child_t children[16] = {};
+  };
+
+  // slots[byte] - индекс ребенка плюс один, 0 - ребенка нет
+  struct node48 : inner {
+    node48() : inner(kind::node48) {}
+
+    std::uint8_t slots[256] = {};
+    child_t children[48] = {};
+  };
+
+  struct node256 : inner {
+    node256() : inner(kind::node256) {}
+
+    child_t children[256] = {};
+  };
+
+public:
+  radix_index() = default;
+
+  radix_index(radix_index const&) = delete;
+  radix_index& operator=(radix_index const&) = delete;
+
+  ~radix_index() {
+    destroy(root);
+  }
+
+  bool enabled() const {
+    return !disabled;
+  }
+
+  void swap(radix_index& other) noexcept {
+    std::swap(root, other.root);
+    std::swap(disabled, other.disabled);
+  }
+
+  // Удаляет все и снова включает индекс
+  void clear() noexcept {
+    destroy(std::exchange(root, 0));
+    disabled = false;
+  }
+
+  Element* find(T const& value) const {
+    auto key = ordered(value);
+    child_t child = root;
+    // Префиксы на спуске не проверяются, ключ элемента сравнивается в конце
+    for (std::size_t depth = 0; child != 0 && !is_leaf(child); depth++) {
+      auto* node = inner_of(child);
+      depth += node->prefix_length;
+      auto* next = find_child(node, byte_at(key, depth));
+      child = next == nullptr ? 0 : *next;
+    }
+    return child != 0 && key_of(child) == key ? element_of(child) : nullptr;
+  }
+
+  // Элемент с наименьшим ключом не меньше `value`, nullptr, если его нет
+  Element* lower_bound(T const& value) const {
+    return lower_bound(root, ordered(value), 0);
+  }
+
+  // Ключа `element` еще не должно быть в индексе
+  void insert(Element* element) noexcept {
+    if (disabled) {
+      return;
+    }
+    if (!insert(root, ordered(element->value), leaf_of(element), 0)) {
+      clear();
+      disabled = true;
+    }
+  }
+
+  void erase(T const& value) noexcept {
+    if (disabled || root == 0) {
+      return;
+    }
+    if (is_leaf(root)) {
+      root = 0;
+      return;
+    }
+    erase(root, ordered(value), 0);
+  }
+
+  // Направляет ключ `element` на него вместо заменяемого элемента
+  void replace(Element* element) noexcept {
+    if (disabled) {
+      return;
+    }
+    auto key = ordered(element->value);
+    child_t* slot = &root;
+    for (std::size_t depth = 0; *slot != 0 && !is_leaf(*slot); depth++) {
+      auto* node = inner_of(*slot);
+      depth += node->prefix_length;
+      slot = find_child(node, byte_at(key, depth));
+      if (slot == nullptr) {
+        return;
+      }
+    }
+    if (*slot != 0) {
+      *slot = leaf_of(element);
+    }
+  }
+
+private:
+  // Беззнаковые ключи в порядке знаковых
+  static key_type ordered(T value) {
+    auto key = static_cast<key_type>(value);
+    if constexpr (std::is_signed_v<T>) {
+      key ^= key_type(1) << (key_size * 8 - 1);
+    }
+    return key;
+  }
+
+  static std::uint8_t byte_at(key_type key, std::size_t depth) {
+    return static_cast<std::uint8_t>(key >> (8 * (key_size - 1 - depth)));
+  }
+
+  static bool is_leaf(child_t child) {
+    return child & 1;
+  }
+
+  static Element* element_of(child_t child) {
+    return reinterpret_cast<Element*>(child & ~child_t(1));
+  }
+
+  static child_t leaf_of(Element* element) {
+    return reinterpret_cast<child_t>(element) | 1;
+  }
+
+  static inner* inner_of(child_t child) {
+    return reinterpret_cast<inner*>(child);
+  }
+
+  static child_t child_of(inner* node) {
+    return reinterpret_cast<child_t>(node);
+  }
+
+  static key_type key_of(child_t leaf) {
+    return ordered(element_of(leaf)->value);
+  }
+
+  static void destroy(child_t child) noexcept {
+    if (child == 0 || is_leaf(child)) {
+      return;
+    }
+    auto* node = inner_of(child);
+    for_each_child(node, [](std::uint8_t, child_t grandchild) {
+      destroy(grandchild);
+      return false;
+    });
+    free(node);
+  }
+
+  static void free(inner* node) noexcept {
+    switch (node->type) {
+    case kind::node4:
+      delete static_cast<node4*>(node);
+      break;
+    case kind::node16:
+      delete static_cast<node16*>(node);
+      break;
+    case kind::node48:
+      delete static_cast<node48*>(node);
+      break;
+    case kind::node256:
+      delete static_cast<node256*>(node);
+      break;
+    }
+  }
+
+  // Вызывает f(byte, child) по возрастанию байтов, пока она не вернет true,
+  // возвращает этого ребенка или 0
+  template <typename F>
+  static child_t for_each_child(inner* node, F f, unsigned from = 0) {
+    switch (node->type) {
+    case kind::node4:
+      return for_each_sorted(static_cast<node4*>(node), f, from);
+    case kind::node16:
+      return for_each_sorted(static_cast<node16*>(node), f, from);
+    case kind::node48: {
+      auto* node48_ptr = static_cast<node48*>(node);
+      for (unsigned byte = from; byte < 256; byte++) {
+        auto slot = node48_ptr->slots[byte];
+        if (slot != 0 && f(byte, node48_ptr->children[slot - 1])) {
+          return node48_ptr->children[slot - 1];
+        }
+      }
+      return 0;
+    }
+    case kind::node256: {
+      auto* node256_ptr = static_cast<node256*>(node);
+      for (unsigned byte = from; byte < 256; byte++) {
+        auto child = node256_ptr->children[byte];
+        if (child != 0 && f(byte, child)) {
+          return child;
+        }
+      }
+      return 0;
+    }
+    }
+    return 0;
+  }
+
+  template <typename Node, typename F>
+  static child_t for_each_sorted(Node* node, F& f, unsigned from) {
+    for (std::size_t i = 0; i < node->count; i++) {
+      if (node->keys[i] >= from && f(node->keys[i], node->children[i])) {
+        return node->children[i];
+      }
+    }
+    return 0;
+  }
+
+  static child_t* find_child(inner* node, std::uint8_t byte) {
+    switch (node->type) {
+    case kind::node4:
+      return find_sorted(static_cast<node4*>(node), byte);
+    case kind::node16:
+      return find_sorted(static_cast<node16*>(node), byte);
+    case kind::node48: {
+      auto* node48_ptr = static_cast<node48*>(node);
+      auto slot = node48_ptr->slots[byte];
+      return slot == 0 ? nullptr : &node48_ptr->children[slot - 1];
+    }
+    case kind::node256: {
+      auto& child = static_cast<node256*>(node)->children[byte];
+      return child == 0 ? nullptr : &child;
+    }
+    }
+    return nullptr;
+  }
+
+  template <typename Node>
+  static child_t* find_sorted(Node* node, std::uint8_t byte) {
+    for (std::size_t i = 0; i < node->count; i++) {
+      if (node->keys[i] == byte) {
+        return &node->children[i];
+      }
+    }
+    return nullptr;
+  }
+
+  static child_t minimum(child_t child) {
+    while (!is_leaf(child)) {
+      child = for_each_child(inner_of(child),
+                             [](std::uint8_t, child_t) { return true; });
+    }
+    return child;
+  }
+
+  Element* lower_bound(child_t child, key_type key, std::size_t depth) const {
+    if (child == 0) {
+      return nullptr;
+    }
+    if (is_leaf(child)) {
+      return key_of(child) >= key ? element_of(child) : nullptr;
+    }
+    auto* node = inner_of(child);
+    for (std::size_t i = 0; i < node->prefix_length; i++) {
+      auto byte = byte_at(key, depth + i);
+      if (node->prefix[i] != byte) {
+        return node->prefix[i] > byte ? element_of(minimum(child)) : nullptr;
+      }
+    }
+    depth += node->prefix_length;
+    auto byte = byte_at(key, depth);
+    if (auto* exact = find_child(node, byte)) {
+      if (auto* result = lower_bound(*exact, key, depth + 1)) {
+        return result;
+      }
+    }
+    auto next = for_each_child(
+        node, [](std::uint8_t, child_t) { return true; }, byte + 1u);
+    return next == 0 ? nullptr : element_of(minimum(next));
+  }
+
+  template <typename Node>
+  static void insert_sorted(Node* node, std::uint8_t byte, child_t child) {
+    std::size_t i = node->count;
+    for (; i > 0 && node->keys[i - 1] > byte; i--) {
+      node->keys[i] = node->keys[i - 1];
+      node->children[i] = node->children[i - 1];
+    }
+    node->keys[i] = byte;
+    node->children[i] = child;
+    node->count++;
+  }
+
+  static void copy_prefix(inner const* from, inner* to) {
+    to->prefix_length = from->prefix_length;
+    std::copy(from->prefix, from->prefix + from->prefix_length, to->prefix);
+  }
+
+  // Переносит детей `node` в `to`, который заменяет его в `slot`
+  template <typename Node>
+  static void move_children(inner* node, Node* to, child_t& slot) {
+    copy_prefix(node, to);
+    for_each_child(node, [&](std::uint8_t byte, child_t child) {
+      add_child(to, byte, child);
+      return false;
+    });
+    free(node);
+    slot = child_of(to);
+  }
+
+  // В `node` есть место для ребенка
+  static void add_child(inner* node, std::uint8_t byte, child_t child) {
+    switch (node->type) {
+    case kind::node4:
+      add_child(static_cast<node4*>(node), byte, child);
+      break;
+    case kind::node16:
+      add_child(static_cast<node16*>(node), byte, child);
+      break;
+    case kind::node48:
+      add_child(static_cast<node48*>(node), byte, child);
+      break;
+    case kind::node256:
+      add_child(static_cast<node256*>(node), byte, child);
+      break;
+    }
+  }
+
+  // Типизированная версия для тех, кто знает вид узла, чтобы компилятор не
+  // видел в обращениях к узлу обращения к узлу другого вида
+  template <typename Node>
+  static void add_child(Node* node, std::uint8_t byte, child_t child) {
+    if constexpr (std::is_same_v<Node, node48>) {
+      std::size_t index = 0;
+      while (node->children[index] != 0) {
+        index++;
+      }
+      node->children[index] = child;
+      node->slots[byte] = static_cast<std::uint8_t>(index + 1);
+      node->count++;
+    } else if constexpr (std::is_same_v<Node, node256>) {
+      node->children[byte] = child;
+      node->count++;
+    } else {
+      insert_sorted(node, byte, child);
+    }
+  }
+
+  static std::size_t capacity(inner const* node) {
+    switch (node->type) {
+    case kind::node4:
+      return 4;
+    case kind::node16:
+      return 16;
+    case kind::node48:
+      return 48;
+    default:
+      return 256;
+    }
+  }
+
+  // Добавляет ребенка узлу в `slot`, увеличивая узел, если он полон
+  static bool add_child(child_t& slot, std::uint8_t byte, child_t child) {
+    auto* node = inner_of(slot);
+    if (node->count == capacity(node)) {
+      inner* grown = nullptr;
+      switch (node->type) {
+      case kind::node4:
+        grown = grow<node16>(node, slot);
+        break;
+      case kind::node16:
+        grown = grow<node48>(node, slot);
+        break;
+      default:
+        grown = grow<node256>(node, slot);
+        break;
+      }
+      if (grown == nullptr) {
+        return false;
+      }
+      node = grown;
+    }
+    add_child(node, byte, child);
+    return true;
+  }
+
+  template <typename Node>
+  static inner* grow(inner* node, child_t& slot) {
+    auto* grown = new (std::nothrow) Node();
+    if (grown != nullptr) {
+      move_children(node, grown, slot);
+    }
+    return grown;
+  }
+
+  static bool insert(child_t& slot, key_type key, child_t leaf,
+                     std::size_t depth) {
+    if (slot == 0) {
+      slot = leaf;
+      return true;
+    }
+    if (is_leaf(slot)) {
+      // Ключи уникальны и одной длины, поэтому где-то они различаются
+      auto other = key_of(slot);
+      std::size_t split = depth;
+      while (byte_at(other, split) == byte_at(key, split)) {
+        split++;
+      }
+      auto* node = new (std::nothrow) node4();
+      if (node == nullptr) {
+        return false;
+      }
+      node->prefix_length = static_cast<std::uint8_t>(split - depth);
+      for (std::size_t i = depth; i < split; i++) {
+        node->prefix[i - depth] = byte_at(key, i);
+      }
+      insert_sorted(node, byte_at(other, split), slot);
+      insert_sorted(node, byte_at(key, split), leaf);
+      slot = child_of(node);
+      return true;
+    }
+
+    auto* node = inner_of(slot);
+    for (std::size_t i = 0; i < node->prefix_length; i++) {
+      if (node->prefix[i] == byte_at(key, depth + i)) {
+        continue;
+      }
+      // Ключ уходит со сжатого пути: разрезаем его в i
+      auto* parent = new (std::nothrow) node4();
+      if (parent == nullptr) {
+        return false;
+      }
+      parent->prefix_length = static_cast<std::uint8_t>(i);
+      std::copy(node->prefix, node->prefix + i, parent->prefix);
+      insert_sorted(parent, node->prefix[i], slot);
+      insert_sorted(parent, byte_at(key, depth + i), leaf);
+      node->prefix_length -= static_cast<std::uint8_t>(i + 1);
+      auto* rest = node->prefix + i + 1;
+      std::copy(rest, rest + node->prefix_length, node->prefix);
+      slot = child_of(parent);
+      return true;
+    }
+    depth += node->prefix_length;
+    auto byte = byte_at(key, depth);
+    if (auto* child = find_child(node, byte)) {
+      return insert(*child, key, leaf, depth + 1);
+    }
+    return add_child(slot, byte, leaf);
+  }
+
+  static void erase(child_t& slot, key_type key, std::size_t depth) {
+    auto* node = inner_of(slot);
+    depth += node->prefix_length;
+    auto byte = byte_at(key, depth);
+    auto* child = find_child(node, byte);
+    if (child == nullptr) {
+      return;
+    }
+    if (!is_leaf(*child)) {
+      erase(*child, key, depth + 1);
+      return;
+    }
+    if (key_of(*child) != key) {
+      return;
+    }
+    remove_child(node, byte);
+    shrink(slot);
+  }
+
+  static void remove_child(inner* node, std::uint8_t byte) {
+    switch (node->type) {
+    case kind::node4:
+      remove_sorted(static_cast<node4*>(node), byte);
+      break;
+    case kind::node16:
+      remove_sorted(static_cast<node16*>(node), byte);
+      break;
+    case kind::node48: {
+      auto* node48_ptr = static_cast<node48*>(node);
+      node48_ptr->children[node48_ptr->slots[byte] - 1] = 0;
+      node48_ptr->slots[byte] = 0;
+      node->count--;
+      break;
+    }
+    case kind::node256:
+      static_cast<node256*>(node)->children[byte] = 0;
+      node->count--;
+      break;
+    }
+  }
+
+  template <typename Node>
+  static void remove_sorted(Node* node, std::uint8_t byte) {
+    std::size_t i = 0;
+    while (node->keys[i] != byte) {
+      i++;
+    }
+    for (; i + 1 < node->count; i++) {
+      node->keys[i] = node->keys[i + 1];
+      node->children[i] = node->children[i + 1];
+    }
+    node->count--;
+  }
+
+  // Заменяет недозаполненный узел в `slot` меньшим. node4 с одним ребенком
+  // сливается с ним, остальные сжатия пропускаются, если меньший узел не
+  // удалось выделить.
+  static void shrink(child_t& slot) noexcept {
+    auto* node = inner_of(slot);
+    switch (node->type) {
+    case kind::node4: {
+      if (node->count != 1) {
+        return;
+      }
+      auto* node4_ptr = static_cast<node4*>(node);
+      auto child = node4_ptr->children[0];
+      // При однобайтовых ключах все дети корня - листья
+      if constexpr (key_size > 1) {
+        if (!is_leaf(child)) {
+          auto* only = inner_of(child);
+          // Слитый путь короче ключа, поэтому помещается
+          std::uint8_t prefix[key_size];
+          std::size_t length = node->prefix_length;
+          std::copy(node->prefix, node->prefix + length, prefix);
+          prefix[length++] = node4_ptr->keys[0];
+          std::copy(only->prefix, only->prefix + only->prefix_length,
+                    prefix + length);
+          length += only->prefix_length;
+          only->prefix_length = static_cast<std::uint8_t>(length);
+          std::copy(prefix, prefix + length, only->prefix);
+        }
+      }
+      free(node);
+      slot = child;
+      return;
+    }
+    case kind::node16:
+      if (node->count == 3) {
+        shrink_to<node4>(node, slot);
+      }
+      return;
+    case kind::node48:
+      if (node->count == 12) {
+        shrink_to<node16>(node, slot);
+      }
+      return;
+    case kind::node256:
+      if (node->count == 37) {
+        shrink_to<node48>(node, slot);
+      }
+      return;
+    }
+  }
+
+  template <typename Node>
+  static void shrink_to(inner* node, child_t& slot) noexcept {
+    if (auto* smaller = new (std::nothrow) Node()) {
+      move_children(node, smaller, slot);
+    }
+  }
+
+  child_t root = 0;
+  bool disabled = false;
+};
+
+} // namespace intrusive
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+
+#if __has_include(<unistd.h>)
+#include <cerrno>
+#include <unistd.h>
+#define BIMAP_HAS_FD_STREAMS 1
+#endif
+
+namespace serialization {
+
+inline void write_bytes(std::ostream& out, void const* data, std::size_t size) {
+  out.write(static_cast<char const*>(data),
+            static_cast<std::streamsize>(size));
+  if (!out) {
+    throw std::runtime_error("bimap snapshot: write failed");
+  }
+}
+
+inline void read_bytes(std::istream& in, void* data, std::size_t size) {
+  in.read(static_cast<char*>(data), static_cast<std::streamsize>(size));
+  if (!in) {
+    throw std::runtime_error("bimap snapshot: unexpected end of input");
+  }
+}
+
+#ifdef BIMAP_HAS_FD_STREAMS
+// Буферизованный std::streambuf поверх файлового дескриптора, нужен для
+// save/load от fd. Дескриптор не закрывается.
+class fd_streambuf : public std::streambuf {
+public:
+  explicit fd_streambuf(int fd) : fd(fd) {
+    setg(get_buffer.data(), get_buffer.data(), get_buffer.data());
+    setp(put_buffer.data(), put_buffer.data() + put_buffer.size());
+  }
+
+  fd_streambuf(fd_streambuf const&) = delete;
+  fd_streambuf& operator=(fd_streambuf const&) = delete;
+
+  ~fd_streambuf() override {
+    flush_buffer();
+  }
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (!flush_buffer()) {
+      return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  int sync() override {
+    return flush_buffer() ? 0 : -1;
+  }
+
+  int_type underflow() override {
+    ssize_t count;
+    do {
+      count = ::read(fd, get_buffer.data(), get_buffer.size());
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+      return traits_type::eof();
+    }
+    setg(get_buffer.data(), get_buffer.data(), get_buffer.data() + count);
+    return traits_type::to_int_type(*gptr());
+  }
+
+private:
+  bool flush_buffer() {
+    for (char* ptr = pbase(); ptr != pptr();) {
+      ssize_t count = ::write(fd, ptr, pptr() - ptr);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        return false;
+      }
+      ptr += count;
+    }
+    setp(put_buffer.data(), put_buffer.data() + put_buffer.size());
+    return true;
+  }
+
+  int fd;
+  std::array<char, 1 << 16> get_buffer;
+  std::array<char, 1 << 16> put_buffer;
+};
+#endif
+
+} // namespace serialization
+
+// Точка расширения для bimap::save/load. Для своих типов специализируйте
+// с двумя статическими функциями:
+//   static void save(std::ostream&, T const&);
+//   static T load(std::istream&);
+template <typename T, typename = void>
+struct bimap_serializer;
+
+template <typename T>
+struct bimap_serializer<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+  static void save(std::ostream& out, T const& value) {
+    serialization::write_bytes(out, &value, sizeof(T));
+  }
+
+  static T load(std::istream& in) {
+    // T может не иметь конструктора по умолчанию: байты читаются прямо в
+    // память неинициализированного члена union
+    union storage {
+      storage() {}
+      T value;
+    } result;
+    serialization::read_bytes(in, &result.value, sizeof(T));
+    return result.value;
+  }
+};
+
+template <typename Char, typename Traits, typename Allocator>
+struct bimap_serializer<
+    std::basic_string<Char, Traits, Allocator>,
+    std::enable_if_t<std::is_trivially_copyable_v<Char>>> {
+  using string_t = std::basic_string<Char, Traits, Allocator>;
+
+  static void save(std::ostream& out, string_t const& value) {
+    bimap_serializer<std::uint64_t>::save(out, value.size());
+    serialization::write_bytes(out, value.data(), value.size() * sizeof(Char));
+  }
+
+  static string_t load(std::istream& in) {
+    auto size = bimap_serializer<std::uint64_t>::load(in);
+    string_t value;
+    // Растим строку по мере чтения, чтобы битый размер не стал аллокацией
+    constexpr std::uint64_t chunk = 1 << 12;
+    for (std::uint64_t done = 0; done < size;) {
+      auto count = std::min(chunk, size - done);
+      value.resize(done + count);
+      serialization::read_bytes(in, value.data() + done, count * sizeof(Char));
+      done += count;
+    }
+    return value;
+  }
+};
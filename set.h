@@ -1,7 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 
+#include "radix-index.h"
+
 namespace intrusive {
 
 struct set_element_base {
@@ -47,18 +56,202 @@ struct set_element_base {
   }
 };
 
-template <typename T, typename Tag>
+// Упорядочивает значения по Compare от Proj{}(value). Множества с ним
+// хранят проекцию каждого элемента, поэтому спуск проецирует искомое
+// значение один раз и никогда не проецирует хранимые. Proj и Compare должны
+// быть без состояния: элементы проецируют свои значения без множества.
+template <typename Proj, typename Compare = std::less<>>
+struct by_projection {
+  static_assert(std::is_empty_v<Proj> && std::is_empty_v<Compare>,
+                "by_projection needs stateless Proj and Compare");
+
+  template <typename A, typename B>
+  bool operator()(A const& a, B const& b) const {
+    return Compare{}(Proj{}(a), Proj{}(b));
+  }
+};
+
+// key_cache<T, Compare>::type задает, что множество T с Compare хранит
+// рядом с каждым значением, чтобы упорядочивать элементы, не читая его:
+// `key`, построенный make(value) и упорядоченный less(). Точный (exact) ключ
+// упорядочивает значения как Compare, иначе равные ключи разрешаются
+// сравнением самих значений.
+template <typename T, typename Compare>
+struct key_cache {
+  using type = void;
+};
+
+template <typename T, typename Compare>
+using key_cache_t = typename key_cache<T, Compare>::type;
+
+// Различные key_prefix(value) упорядочивают строки как Compare, поэтому
+// спуск читает саму строку только при равенстве префиксов: на каждом уровне
+// экономится чтение из буфера строки в куче.
+struct string_prefix_cache {
+  using key = std::uint64_t;
+  static constexpr bool exact = false;
+
+  static key make(std::string const& value);
+
+  static bool less(key a, key b) {
+    return a < b;
+  }
+};
+
+template <>
+struct key_cache<std::string, std::less<std::string>> {
+  using type = string_prefix_cache;
+};
+
+template <>
+struct key_cache<std::string, std::less<>> {
+  using type = string_prefix_cache;
+};
+
+template <typename T, typename Proj, typename Compare>
+struct projection_cache {
+  using key = std::decay_t<std::invoke_result_t<Proj const&, T const&>>;
+  static constexpr bool exact = true;
+
+  static key make(T const& value) {
+    return Proj{}(value);
+  }
+
+  static bool less(key const& a, key const& b) {
+    return Compare{}(a, b);
+  }
+};
+
+template <typename T, typename Proj, typename Compare>
+struct key_cache<T, by_projection<Proj, Compare>> {
+  using type = projection_cache<T, Proj, Compare>;
+};
+
+// Первые 8 байт как big-endian число, короткие строки дополнены нулями.
+// char_traits<char> сравнивает байты как unsigned char, здесь так же.
+inline std::uint64_t key_prefix(std::string const& value) {
+  unsigned char bytes[sizeof(std::uint64_t)] = {};
+  std::memcpy(bytes, value.data(), std::min(value.size(), sizeof(bytes)));
+  std::uint64_t prefix = 0;
+  for (auto byte : bytes) {
+    prefix = prefix << 8 | byte;
+  }
+  return prefix;
+}
+
+inline std::uint64_t string_prefix_cache::make(std::string const& value) {
+  return key_prefix(value);
+}
+
+// Cache - key_cache_t множества, его ключ лежит перед значением
+template <typename T, typename Tag, typename Cache = void>
 struct set_element : set_element_base {
+  typename Cache::key cached;
+  T value;
+
+  set_element(T const& value) : value(value) {
+    refresh_cache();
+  }
+  set_element(T&& value) : value(std::move(value)) {
+    refresh_cache();
+  }
+
+  // Вызывается после изменения `value` на месте
+  void refresh_cache() {
+    cached = Cache::make(value);
+  }
+};
+
+template <typename T, typename Tag>
+struct set_element<T, Tag, void> : set_element_base {
   T value;
 
   set_element(T const& value) : value(value) {}
   set_element(T&& value) : value(std::move(value)) {}
+
+  void refresh_cache() {}
 };
 
-template <class T, class Tag, typename Compare = std::less<T>>
+// Арифметические ключи с std::less или std::greater дешево сравнивать, и
+// они редко равны искомому, поэтому множества таких ключей спускаются без
+// проверки на равенство (см. set::descend).
+template <typename T, typename Compare>
+inline constexpr bool branchless_descent_v =
+    std::is_arithmetic_v<T> &&
+    (std::is_same_v<Compare, std::less<T>> ||
+     std::is_same_v<Compare, std::less<>> ||
+     std::is_same_v<Compare, std::greater<T>> ||
+     std::is_same_v<Compare, std::greater<>>);
+
+inline void prefetch(void const* pointer) {
+#if defined(__GNUC__)
+  __builtin_prefetch(pointer);
+#else
+  (void)pointer;
+#endif
+}
+
+struct set_stats {
+  std::size_t comparisons = 0;
+  std::size_t rotations = 0;
+  std::size_t swap_links = 0;
+  // Узлы, пройденные при восстановлении баланса после вставок и удалений
+  std::size_t rebalance_steps = 0;
+  std::size_t max_depth = 0;
+  double average_depth = 0;
+};
+
+template <bool Enabled>
+struct set_counters {
+  void comparison() {}
+  void rotation() {}
+  void swap_link() {}
+  void rebalance_step() {}
+};
+
+template <>
+struct set_counters<true> {
+  std::size_t comparisons = 0;
+  std::size_t rotations = 0;
+  std::size_t swap_links = 0;
+  std::size_t rebalance_steps = 0;
+
+  void comparison() {
+    comparisons++;
+  }
+  void rotation() {
+    rotations++;
+  }
+  void swap_link() {
+    swap_links++;
+  }
+  void rebalance_step() {
+    rebalance_steps++;
+  }
+};
+
+struct no_index {};
+
+// С RadixIndex множество хранит radix_index своих элементов рядом с
+// деревом: поиск и вставка спускаются по индексу, а не по дереву, порядок
+// по-прежнему держит дерево. Ключи в этом случае должны быть уникальны.
+template <class T, class Tag, typename Compare = std::less<T>,
+          bool CollectStats = false, bool RadixIndex = false>
 struct set : Compare { /// AVL-tree
 
+  static constexpr bool branchless = branchless_descent_v<T, Compare>;
+  using cache_type = key_cache_t<T, Compare>;
+  static constexpr bool caches_key = !std::is_void_v<cache_type>;
+  using element_type = set_element<T, Tag, cache_type>;
+
+  static_assert(!RadixIndex || radix_indexable_v<T, Compare>,
+                "radix index needs integral keys ordered by std::less");
+
   mutable set_element_base m_root;
+  [[no_unique_address]] mutable set_counters<CollectStats> counters;
+  using index_type =
+      std::conditional_t<RadixIndex, radix_index<T, element_type>, no_index>;
+  [[no_unique_address]] index_type index;
 
   explicit set(Compare compare = Compare()) : Compare(std::move(compare)) {}
 
@@ -68,43 +261,147 @@ struct set : Compare { /// AVL-tree
     return static_cast<const Compare&>(*this);
   }
 
+  bool less(T const& left, T const& right) const {
+    counters.comparison();
+    return cmp()(left, right);
+  }
+
+  // Счетчики нулевые без CollectStats, глубины (корень на глубине 1)
+  // считаются полным обходом.
+  set_stats stats() const {
+    set_stats result;
+    if constexpr (CollectStats) {
+      result.comparisons = counters.comparisons;
+      result.rotations = counters.rotations;
+      result.swap_links = counters.swap_links;
+      result.rebalance_steps = counters.rebalance_steps;
+    }
+    std::size_t count = 0;
+    std::size_t total_depth = 0;
+    collect_depths(m_root.left, 1, count, total_depth, result.max_depth);
+    if (count != 0) {
+      result.average_depth = static_cast<double>(total_depth) / count;
+    }
+    return result;
+  }
+
+  void reset_stats() {
+    counters = {};
+  }
+
   set_element_base* lower_bound(const T& value) const {
-    return lower_bound(value, m_root.left);
+    if constexpr (RadixIndex) {
+      if (index.enabled()) {
+        auto* element = index.lower_bound(value);
+        return element ? element : &m_root;
+      }
+    }
+    if constexpr (branchless) {
+      return descend<false>(value);
+    }
+    return lower_bound(value, key_of(value), m_root.left);
+  }
+
+  // Поиск от пальца: `hint` - end_ptr() или элемент меньше `value`.
+  // Подъем идет, только пока поддерево не может содержать ответ, поэтому
+  // стоимость логарифмична по расстоянию от `hint`.
+  set_element_base* lower_bound_from(const T& value,
+                                     set_element_base* hint) const {
+    if constexpr (RadixIndex) {
+      if (index.enabled()) {
+        return lower_bound(value);
+      }
+    }
+    auto key = key_of(value);
+    if (hint == &m_root) {
+      return lower_bound(value, key, m_root.left);
+    }
+    auto* pointer = hint;
+    while (pointer->parent != &m_root) {
+      auto* parent = pointer->parent;
+      if (parent->left == pointer &&
+          !less_by_key<false>(parent, value, key)) {
+        break;
+      }
+      pointer = parent;
+    }
+    return lower_bound(value, key, pointer);
   }
 
   set_element_base* upper_bound(const T& value) const {
-    set_element_base* tmp_pointer = lower_bound(value);
+    if constexpr (RadixIndex) {
+      if (index.enabled()) {
+        auto* pointer = lower_bound(value);
+        if (pointer != &m_root && !less(value, get_value(pointer))) {
+          return pointer->next();
+        }
+        return pointer;
+      }
+    }
+    if constexpr (branchless) {
+      return descend<true>(value);
+    }
+    auto key = key_of(value);
+    set_element_base* tmp_pointer = lower_bound(value, key, m_root.left);
     if (tmp_pointer == &m_root) {
       return &m_root;
     }
-    if (cmp()(get_value(tmp_pointer), value) ==
-        cmp()(value, get_value(tmp_pointer))) {
+    if (compare(tmp_pointer, value, key) == 0) {
       return tmp_pointer->next();
     }
     return tmp_pointer;
   }
 
   set_element_base* find_ptr(const T& value) const {
-    set_element_base* pointer = lower_bound(value);
-
-    if (pointer == &m_root) {
-      return &m_root;
+    if constexpr (RadixIndex) {
+      if (index.enabled()) {
+        auto* element = index.find(value);
+        return element ? element : &m_root;
+      }
     }
-
-    if (cmp()(get_value(pointer), value) != cmp()(value, get_value(pointer))) {
+    if constexpr (branchless) {
+      auto* pointer = descend<false>(value);
+      if (pointer != &m_root && !less(value, get_value(pointer))) {
+        return pointer;
+      }
       return &m_root;
     }
-
-    return pointer;
+    auto key = key_of(value);
+    for (auto* pointer = m_root.left; pointer != nullptr;) {
+      int order = compare(pointer, value, key);
+      if (order == 0) {
+        return pointer;
+      }
+      pointer = order < 0 ? pointer->right : pointer->left;
+    }
+    return &m_root;
   }
 
-  void insert(set_element<T, Tag>& element) {
-    if (m_root.left == nullptr) {
-      m_root.left = &static_cast<set_element_base&>(element);
-      m_root.left->parent = &m_root;
-      return;
+  void insert(element_type& element) {
+    if constexpr (RadixIndex) {
+      if (index.enabled()) {
+        insert_before(element, lower_bound(element.value));
+        return;
+      }
     }
-    insert(element, m_root.left);
+    auto const& key = key_of(element);
+    set_element_base* parent = &m_root;
+    set_element_base** link = &m_root.left;
+    while (*link != nullptr) {
+      parent = *link;
+      bool right;
+      if constexpr (branchless) {
+        prefetch(parent->left);
+        prefetch(parent->right);
+        right = !less(element.value, get_value(parent));
+      } else {
+        right = !less_by_key<true>(parent, element.value, key);
+      }
+      link = right ? &parent->right : &parent->left;
+    }
+    *link = &element;
+    element.parent = parent;
+    retrace(parent);
   }
 
   void erase(const T& value) {
@@ -112,11 +409,151 @@ struct set : Compare { /// AVL-tree
     if (pointer == &m_root) {
       return;
     }
-    pointer = erase(pointer);
-    while (pointer != &m_root) {
-      auto* tmp_ptr = pointer->parent;
-      correcter(pointer);
-      pointer = tmp_ptr;
+    unlink(pointer);
+  }
+
+  // Оставляет элемент без связей, его можно вставить снова.
+  void unlink(set_element_base* element) {
+    if constexpr (RadixIndex) {
+      index.erase(get_value(element));
+    }
+    retrace(erase(element));
+    if constexpr (RadixIndex) {
+      if (m_root.left == nullptr) {
+        index.clear();
+      }
+    }
+    element->left = element->right = element->parent = nullptr;
+    element->height = 1;
+  }
+
+  // Вставляет `element` прямо перед `position` без сравнений, порядок
+  // гарантирует вызывающий.
+  void insert_before(element_type& element,
+                     set_element_base* position) {
+    set_element_base* pointer = &element;
+    set_element_base* parent;
+    if (position->left == nullptr) {
+      parent = position;
+      parent->left = pointer;
+    } else {
+      parent = position->left->get_max_node_ptr();
+      parent->right = pointer;
+    }
+    pointer->parent = parent;
+    retrace(parent);
+    if constexpr (RadixIndex) {
+      index.insert(&element);
+    }
+  }
+
+  // Вынимает [first, last) двумя split и одним join, O(log n). Возвращает
+  // корень вынутого поддерева, его parent - nullptr.
+  set_element_base* extract(set_element_base* first, set_element_base* last) {
+    auto [lower, middle] = split(detach_root(), get_value(first));
+    set_element_base* upper = nullptr;
+    if (last != &m_root) {
+      std::tie(middle, upper) = split(middle, get_value(last));
+    }
+    attach_root(join(lower, upper));
+    if constexpr (RadixIndex) {
+      if (m_root.left == nullptr) {
+        index.clear();
+      } else {
+        for (auto* pointer = middle->get_min_node_ptr(); pointer;
+             pointer = pointer->next()) {
+          index.erase(get_value(pointer));
+        }
+      }
+    }
+    return middle;
+  }
+
+  // Строит дерево той же формы, что у `other`, `clone` отображает его
+  // элементы в новые. Если `clone` бросает, ничего не подвешивается.
+  template <typename Clone>
+  void clone_shape(set const& other, Clone clone) {
+    attach_root(clone_subtree(other.m_root.left, clone));
+    index_all();
+  }
+
+  // Ставит `to`, не лежащий ни в одном дереве, на место `from`. Их ключи
+  // должны быть равны.
+  void replace(set_element_base* from, set_element_base* to) {
+    if constexpr (RadixIndex) {
+      index.replace(static_cast<element_type*>(to));
+    }
+    to->left = from->left;
+    to->right = from->right;
+    to->parent = from->parent;
+    to->height = from->height;
+    if (to->left) {
+      to->left->parent = to;
+    }
+    if (to->right) {
+      to->right->parent = to;
+    }
+    if (to->parent->left == from) {
+      to->parent->left = to;
+    } else {
+      to->parent->right = to;
+    }
+  }
+
+  // Строит дерево из `count` элементов, связанных через `left` по порядку,
+  // за O(n) без сравнений. Дерево должно быть пустым.
+  void assemble(set_element_base* head, std::size_t count) {
+    attach_root(build(head, count));
+    index_all();
+  }
+
+  // Перестраивает идеально сбалансированное дерево из элементов, для
+  // которых `dropped` вернул false, за O(n) без сравнений и аллокаций.
+  template <typename Predicate>
+  void rebuild_without(Predicate dropped) {
+    set_element_base* head = nullptr;
+    set_element_base** tail = &head;
+    set_element_base* dropped_head = nullptr;
+    std::size_t count = 0;
+    for (auto* pointer = begin_ptr(); pointer != &m_root;) {
+      auto* next = pointer->next();
+      if (!dropped(pointer)) {
+        // next() не читает `left` уже пройденного элемента
+        *tail = pointer;
+        tail = &pointer->left;
+        count++;
+      } else if constexpr (RadixIndex) {
+        pointer->left = std::exchange(dropped_head, pointer);
+      }
+      pointer = next;
+    }
+    attach_root(build(head, count));
+    if constexpr (RadixIndex) {
+      if (count == 0) {
+        index.clear();
+      }
+      for (; count != 0 && dropped_head; dropped_head = dropped_head->left) {
+        index.erase(get_value(dropped_head));
+      }
+    }
+  }
+
+  // Опустошает множество за O(1), не трогая элементы, и возвращает старый
+  // корень. Radix-индекс, если он есть, переезжает в `into`.
+  set_element_base* release_tree(index_type& into) noexcept {
+    if constexpr (RadixIndex) {
+      index.swap(into);
+    }
+    return std::exchange(m_root.left, nullptr);
+  }
+
+  // Меняется элементами с `other`, компараторы остаются на месте
+  void swap_tree(set& other) noexcept {
+    std::swap(m_root.left, other.m_root.left);
+    attach_root(m_root.left);
+    other.attach_root(other.m_root.left);
+    if constexpr (RadixIndex) {
+      index.swap(other.index);
     }
   }
 
@@ -129,12 +566,157 @@ struct set : Compare { /// AVL-tree
   }
 
 private:
+  static void collect_depths(set_element_base* pointer, std::size_t depth,
+                             std::size_t& count, std::size_t& total_depth,
+                             std::size_t& max_depth) {
+    if (pointer == nullptr) {
+      return;
+    }
+    count++;
+    total_depth += depth;
+    max_depth = std::max(max_depth, depth);
+    collect_depths(pointer->left, depth + 1, count, total_depth, max_depth);
+    collect_depths(pointer->right, depth + 1, count, total_depth, max_depth);
+  }
+
+  set_element_base* detach_root() {
+    return detach(std::exchange(m_root.left, nullptr));
+  }
+
+  // Заносит в индекс элементы дерева, построенного без него
+  void index_all() {
+    if constexpr (RadixIndex) {
+      for (auto* pointer = begin_ptr(); pointer != &m_root;
+           pointer = pointer->next()) {
+        index.insert(static_cast<element_type*>(pointer));
+      }
+    }
+  }
+
+  void attach_root(set_element_base* root) {
+    m_root.left = root;
+    if (root) {
+      root->parent = &m_root;
+    }
+  }
+
+  static set_element_base* detach(set_element_base* pointer) {
+    if (pointer) {
+      pointer->parent = nullptr;
+    }
+    return pointer;
+  }
+
+  template <typename Clone>
+  static set_element_base* clone_subtree(set_element_base* pointer,
+                                         Clone& clone) {
+    if (pointer == nullptr) {
+      return nullptr;
+    }
+    set_element_base* copy = clone(pointer);
+    copy->height = pointer->height;
+    copy->left = clone_subtree(pointer->left, clone);
+    if (copy->left) {
+      copy->left->parent = copy;
+    }
+    copy->right = clone_subtree(pointer->right, clone);
+    if (copy->right) {
+      copy->right->parent = copy;
+    }
+    return copy;
+  }
+
+  // Забирает `count` элементов списка, связанного через `left`.
+  static set_element_base* build(set_element_base*& head, std::size_t count) {
+    if (count == 0) {
+      return nullptr;
+    }
+    auto* left = build(head, count / 2);
+    auto* pointer = head;
+    head = head->left;
+
+    pointer->left = left;
+    if (left) {
+      left->parent = pointer;
+    }
+    pointer->right = build(head, count - count / 2 - 1);
+    if (pointer->right) {
+      pointer->right->parent = pointer;
+    }
+    upd(pointer);
+    return pointer;
+  }
+
+  // У всех корней, переданных в join/split, parent должен быть nullptr.
+  set_element_base* join(set_element_base* left, set_element_base* middle,
+                         set_element_base* right) {
+    if (height(left) > height(right) + 1) {
+      left->right = join(left->right, middle, right);
+      left->right->parent = left;
+      return correcter(left);
+    }
+    if (height(right) > height(left) + 1) {
+      right->left = join(left, middle, right->left);
+      right->left->parent = right;
+      return correcter(right);
+    }
+    middle->left = left;
+    middle->right = right;
+    middle->parent = nullptr;
+    if (left) {
+      left->parent = middle;
+    }
+    if (right) {
+      right->parent = middle;
+    }
+    upd(middle);
+    return middle;
+  }
+
+  set_element_base* join(set_element_base* left, set_element_base* right) {
+    if (left == nullptr) {
+      return right;
+    }
+    if (right == nullptr) {
+      return left;
+    }
+    auto [rest, max] = split_max(left);
+    return join(rest, max, right);
+  }
+
+  std::pair<set_element_base*, set_element_base*>
+  split_max(set_element_base* root) {
+    auto* left = detach(root->left);
+    if (root->right == nullptr) {
+      return {left, root};
+    }
+    auto [rest, max] = split_max(detach(root->right));
+    return {join(left, root, rest), max};
+  }
+
+  // Делит на элементы меньше `value` и остальные.
+  std::pair<set_element_base*, set_element_base*>
+  split(set_element_base* root, T const& value) {
+    if (root == nullptr) {
+      return {nullptr, nullptr};
+    }
+    auto* left = detach(root->left);
+    auto* right = detach(root->right);
+    if (less(get_value(root), value)) {
+      auto [lower, upper] = split(right, value);
+      return {join(left, root, lower), upper};
+    }
+    auto [lower, upper] = split(left, value);
+    return {lower, join(upper, root, right)};
+  }
+
   static void upd(set_element_base* pointer) {
     pointer->height =
         std::max(height(pointer->left), height(pointer->right)) + 1;
   }
 
-  static void left_rotate(set_element_base* pointer) {
+  void left_rotate(set_element_base* pointer) {
+    counters.rotation();
     auto* ptr = pointer;
     pointer = pointer->left;
 
@@ -145,10 +727,12 @@ private:
 
     pointer->parent = ptr->parent;
 
-    if (pointer->parent->left == ptr) {
-      pointer->parent->left = pointer;
-    } else {
-      pointer->parent->right = pointer;
+    if (pointer->parent) {
+      if (pointer->parent->left == ptr) {
+        pointer->parent->left = pointer;
+      } else {
+        pointer->parent->right = pointer;
+      }
     }
 
     pointer->right = ptr;
@@ -158,7 +742,8 @@ private:
     upd(pointer);
   }
 
-  static void right_rotate(set_element_base* pointer) {
+  void right_rotate(set_element_base* pointer) {
+    counters.rotation();
     auto* ptr = pointer;
     pointer = pointer->right;
 
@@ -168,10 +753,13 @@ private:
     }
 
     pointer->parent = ptr->parent;
-    if (pointer->parent->left == ptr) {
-      pointer->parent->left = pointer;
-    } else {
-      pointer->parent->right = pointer;
+
+    if (pointer->parent) {
+      if (pointer->parent->left == ptr) {
+        pointer->parent->left = pointer;
+      } else {
+        pointer->parent->right = pointer;
+      }
     }
 
     pointer->left = ptr;
@@ -192,15 +780,32 @@ private:
     return height(pointer->right) - height(pointer->left);
   }
 
-  static void correcter(set_element_base* pointer) {
+  // Восстанавливает баланс от `pointer` до корня после одной вставки или
+  // удаления под ним, у `pointer` еще старая высота. Останавливается на
+  // первом поддереве, чья высота не изменилась: баланс всего выше него тоже
+  // прежний, поэтому большинство обновлений трогает O(1) узлов.
+  void retrace(set_element_base* pointer) {
+    while (pointer != &m_root) {
+      counters.rebalance_step();
+      auto* parent = pointer->parent;
+      auto height_before = pointer->height;
+      if (correcter(pointer)->height == height_before) {
+        return;
+      }
+      pointer = parent;
+    }
+  }
+
+  // Возвращает новый корень поддерева.
+  set_element_base* correcter(set_element_base* pointer) {
     upd(pointer);
     if (balance(pointer) < 2) {
-      return;
+      return pointer;
     }
 
     if (height(pointer->left) > height(pointer->right)) {
       auto* ptr = pointer->left;
-      if (height(ptr->left) > height(ptr->right)) {
+      if (height(ptr->left) >= height(ptr->right)) {
         left_rotate(pointer);
       } else {
         right_rotate(ptr);
@@ -208,13 +813,14 @@ private:
       }
     } else {
       auto* ptr = pointer->right;
-      if (height(ptr->left) < height(ptr->right)) {
+      if (height(ptr->left) <= height(ptr->right)) {
         right_rotate(pointer);
       } else {
         left_rotate(ptr);
         right_rotate(pointer);
       }
     }
+    return pointer->parent;
   }
 
   static void erase_one_child(set_element_base* pointer) {
@@ -231,7 +837,6 @@ private:
     } else {
       pointer->parent->right = child_ptr;
     }
-    upd(child_ptr->parent);
   }
 
   static void swap_link_in_edge(set_element_base* up, set_element_base* down) {
@@ -290,7 +895,8 @@ private:
     upd(down);
   }
 
-  static void swap_link(set_element_base* up, set_element_base* down) {
+  void swap_link(set_element_base* up, set_element_base* down) {
+    counters.swap_link();
     if (up->left == down || up->right == down) {
       swap_link_in_edge(up, down);
       return;
@@ -329,7 +935,7 @@ private:
     upd(down);
   }
 
-  static set_element_base* erase(set_element_base* pointer) {
+  set_element_base* erase(set_element_base* pointer) {
     if (!(pointer->left) && !(pointer->right)) {
       auto* parent_ptr = pointer->parent;
       if (parent_ptr->left == pointer) {
@@ -351,51 +957,131 @@ private:
   }
 
   static T const& get_value(set_element_base* pointer) {
-    return static_cast<set_element<T, Tag>&>(*pointer).value;
+    return static_cast<element_type&>(*pointer).value;
   }
 
-  void insert(set_element<T, Tag>& element, set_element_base* pointer) {
-    auto& tree_value = get_value(pointer);
-    if (cmp()(element.value, tree_value)) {
-      if (pointer->left) {
-        insert(element, pointer->left);
-      } else {
-        pointer->left = static_cast<set_element_base*>(&element);
-        pointer->left->parent = pointer;
-        upd(pointer);
-        return;
-      }
+  struct no_key {};
+
+  template <typename Cache, typename = void>
+  struct key_of_cache {
+    using type = no_key;
+  };
+  template <typename Cache>
+  struct key_of_cache<Cache, std::void_t<typename Cache::key>> {
+    using type = typename Cache::key;
+  };
+
+  using key_type = typename key_of_cache<cache_type>::type;
+
+  static key_type key_of(T const& value) {
+    if constexpr (caches_key) {
+      return cache_type::make(value);
+    } else {
+      return {};
+    }
+  }
+
+  static decltype(auto) key_of(element_type const& element) {
+    if constexpr (caches_key) {
+      return (element.cached);
     } else {
-      if (pointer->right) {
-        insert(element, pointer->right);
+      return no_key{};
+    }
+  }
+
+  // Отрицательно, если элемент меньше `value`, 0, если они эквивалентны.
+  // `key` - key_of(value).
+  int compare(set_element_base* pointer, T const& value,
+              key_type const& key) const {
+    if constexpr (caches_key) {
+      auto const& element_key = static_cast<element_type&>(*pointer).cached;
+      if constexpr (cache_type::exact) {
+        counters.comparison();
+      }
+      if (cache_type::less(element_key, key)) {
+        return -1;
+      }
+      if (cache_type::less(key, element_key)) {
+        return 1;
+      }
+      if constexpr (cache_type::exact) {
+        return 0;
+      }
+    }
+    if (less(get_value(pointer), value)) {
+      return -1;
+    }
+    return less(value, get_value(pointer)) ? 1 : 0;
+  }
+
+  // less(get_value(pointer), value), а при ValueFirst less(value,
+  // get_value(pointer)), не больше одного вызова компаратора. Кэшированный
+  // ключ решает сам, если он точный или если ключи различны.
+  template <bool ValueFirst>
+  bool less_by_key(set_element_base* pointer, T const& value,
+                   key_type const& key) const {
+    if constexpr (caches_key) {
+      auto const& element_key = static_cast<element_type&>(*pointer).cached;
+      auto const& first = ValueFirst ? key : element_key;
+      auto const& second = ValueFirst ? element_key : key;
+      if constexpr (cache_type::exact) {
+        counters.comparison();
+        return cache_type::less(first, second);
       } else {
-        pointer->right = static_cast<set_element_base*>(&element);
-        pointer->right->parent = pointer;
-        upd(pointer);
-        return;
+        if (cache_type::less(first, second)) {
+          return true;
+        }
+        if (cache_type::less(second, first)) {
+          return false;
+        }
       }
     }
-    correcter(pointer);
+    return ValueFirst ? less(value, get_value(pointer))
+                      : less(get_value(pointer), value);
+  }
+
+  // Первый элемент не меньше `value` (больше него при Upper). Всегда
+  // спускается до листа: направление выбирается условной пересылкой, а не
+  // переходом, и оба ребенка подгружаются (prefetch), пока идет сравнение.
+  template <bool Upper>
+  set_element_base* descend(T const& value) const {
+    set_element_base* result = &m_root;
+    for (auto* pointer = m_root.left; pointer != nullptr;) {
+      prefetch(pointer->left);
+      prefetch(pointer->right);
+      bool right = Upper ? !less(value, get_value(pointer))
+                         : less(get_value(pointer), value);
+      result = right ? result : pointer;
+      pointer = right ? pointer->right : pointer->left;
+    }
+    return result;
   }
 
-  set_element_base* lower_bound(T const& value,
+  // lower_bound в поддереве `pointer` или элемент после поддерева, если все
+  // его элементы меньше `value`.
+  set_element_base* lower_bound(T const& value, key_type const& key,
                                 set_element_base* pointer) const {
     if (pointer == nullptr) {
       return &m_root;
     }
-    if (cmp()(get_value(pointer), value) == cmp()(value, get_value(pointer))) {
-      return pointer;
-    }
-    if (cmp()(get_value(pointer), value)) {
-      if (pointer->right) {
-        return lower_bound(value, pointer->right);
+    set_element_base* successor = nullptr;
+    while (true) {
+      int order = compare(pointer, value, key);
+      if (order == 0) {
+        return pointer;
       }
-      return pointer->next();
-    } else {
-      if (pointer->left) {
-        return lower_bound(value, pointer->left);
+      if (order < 0) {
+        if (pointer->right == nullptr) {
+          return successor != nullptr ? successor : pointer->next();
+        }
+        pointer = pointer->right;
+      } else {
+        if (pointer->left == nullptr) {
+          return pointer;
+        }
+        successor = pointer;
+        pointer = pointer->left;
       }
-      return pointer;
     }
   }
 };
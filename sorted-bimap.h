@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Общая часть неизменяемых bimap, у которых обе стороны лежат
+// отсортированными массивами, а пары связаны индексами (static_bimap,
+// mapped_bimap): итераторы, поиск и границы. Derived хранит массивы и дает
+//   size()              - число пар,
+//   values<IsLeft>()    - указатель на начало массива стороны,
+//   paired<IsLeft>()    - для каждой позиции стороны позицию ее пары на
+//                         другой стороне.
+// Последние два могут быть закрытыми, если Derived объявит sorted_bimap
+// другом.
+template <typename Derived, typename Left, typename Right,
+          typename CompareLeft, typename CompareRight>
+class sorted_bimap {
+public:
+  template <bool IsLeft>
+  struct base_iterator {
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = std::conditional_t<IsLeft, Left, Right>;
+    using pointer = value_type const*;
+    using reference = value_type const&;
+
+    friend class sorted_bimap;
+    friend struct base_iterator<!IsLeft>;
+
+    constexpr base_iterator() = default;
+
+    constexpr base_iterator& operator++() {
+      index++;
+      return *this;
+    }
+    constexpr base_iterator operator++(int) {
+      auto tmp = *this;
+      index++;
+      return tmp;
+    }
+
+    constexpr base_iterator& operator--() {
+      index--;
+      return *this;
+    }
+    constexpr base_iterator operator--(int) {
+      auto tmp = *this;
+      index--;
+      return tmp;
+    }
+
+    constexpr reference operator*() const {
+      return side<IsLeft>(owner)[index];
+    }
+    constexpr pointer operator->() const {
+      return &operator*();
+    }
+
+    constexpr base_iterator<!IsLeft> flip() const {
+      if (index == owner->size()) {
+        return {owner, index};
+      }
+      return {owner, pair_of<IsLeft>(owner, index)};
+    }
+
+    constexpr bool operator==(base_iterator const& other) const {
+      return index == other.index;
+    }
+    constexpr bool operator!=(base_iterator const& other) const {
+      return index != other.index;
+    }
+
+  private:
+    constexpr base_iterator(Derived const* owner, std::size_t index)
+        : owner(owner), index(index) {}
+
+    Derived const* owner = nullptr;
+    std::size_t index = 0;
+  };
+
+  using left_iterator = base_iterator<true>;
+  using right_iterator = base_iterator<false>;
+
+  constexpr left_iterator find_left(Left const& left) const {
+    auto it = lower_bound_left(left);
+    if (it != end_left() && compare_left(left, *it)) {
+      return end_left();
+    }
+    return it;
+  }
+  constexpr right_iterator find_right(Right const& right) const {
+    auto it = lower_bound_right(right);
+    if (it != end_right() && compare_right(right, *it)) {
+      return end_right();
+    }
+    return it;
+  }
+
+  constexpr Right const& at_left(Left const& key) const {
+    auto it = find_left(key);
+    if (it == end_left()) {
+      throw std::out_of_range(
+          "left element wasn't found at 'at_left' function");
+    }
+    return *it.flip();
+  }
+  constexpr Left const& at_right(Right const& key) const {
+    auto it = find_right(key);
+    if (it == end_right()) {
+      throw std::out_of_range(
+          "right element wasn't found at 'at_right' function");
+    }
+    return *it.flip();
+  }
+
+  constexpr left_iterator lower_bound_left(Left const& left) const {
+    return {&derived(), search<false>(lefts(), left, compare_left)};
+  }
+  constexpr left_iterator upper_bound_left(Left const& left) const {
+    return {&derived(), search<true>(lefts(), left, compare_left)};
+  }
+  constexpr right_iterator lower_bound_right(Right const& right) const {
+    return {&derived(), search<false>(rights(), right, compare_right)};
+  }
+  constexpr right_iterator upper_bound_right(Right const& right) const {
+    return {&derived(), search<true>(rights(), right, compare_right)};
+  }
+
+  constexpr left_iterator begin_left() const {
+    return {&derived(), 0};
+  }
+  constexpr left_iterator end_left() const {
+    return {&derived(), count()};
+  }
+  constexpr right_iterator begin_right() const {
+    return {&derived(), 0};
+  }
+  constexpr right_iterator end_right() const {
+    return {&derived(), count()};
+  }
+
+  constexpr bool empty() const {
+    return count() == 0;
+  }
+
+protected:
+  constexpr sorted_bimap(CompareLeft compare_left, CompareRight compare_right)
+      : compare_left(std::move(compare_left)),
+        compare_right(std::move(compare_right)) {}
+
+  [[no_unique_address]] CompareLeft compare_left;
+  [[no_unique_address]] CompareRight compare_right;
+
+private:
+  constexpr Derived const& derived() const {
+    return static_cast<Derived const&>(*this);
+  }
+
+  // Доступ к закрытым массивам Derived, которым нужен friend sorted_bimap
+  template <bool IsLeft>
+  static constexpr auto const* side(Derived const* owner) {
+    return owner->template values<IsLeft>();
+  }
+  template <bool IsLeft>
+  static constexpr std::size_t pair_of(Derived const* owner,
+                                       std::size_t index) {
+    return owner->template paired<IsLeft>()[index];
+  }
+
+  constexpr std::size_t count() const {
+    return derived().size();
+  }
+  constexpr Left const* lefts() const {
+    return side<true>(&derived());
+  }
+  constexpr Right const* rights() const {
+    return side<false>(&derived());
+  }
+
+  // Позиция первого элемента не меньше value (больше него при Upper).
+  // Свой двоичный поиск, а не std::lower_bound: тот не constexpr в
+  // libstdc++ 9 и libc++ 10.
+  template <bool Upper, typename T, typename Compare>
+  constexpr std::size_t search(T const* values, T const& value,
+                               Compare const& compare) const {
+    std::size_t first = 0;
+    std::size_t length = count();
+    while (length > 0) {
+      std::size_t half = length / 2;
+      bool before = Upper ? !compare(value, values[first + half])
+                          : compare(values[first + half], value);
+      if (before) {
+        first += half + 1;
+        length -= half + 1;
+      } else {
+        length = half;
+      }
+    }
+    return first;
+  }
+};
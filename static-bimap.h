@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+#include "sorted-bimap.h"
+
+// Неизменяемый bimap из N пар, который строится в constexpr, например для
+// таблиц enum <-> имя:
+//   constexpr auto names = make_static_bimap<color, std::string_view>(
+//       {{color::red, "red"}, {color::green, "green"}});
+//   static_assert(names.at_right("green") == color::green);
+// Обе стороны лежат внутри объекта отсортированными массивами, связь между
+// парами задается индексами, поиск двоичный (см. sorted_bimap). Ни кучи, ни
+// работы при старте. Повторяющийся left или right бросает
+// std::invalid_argument, в constexpr это ошибка компиляции. Left и Right
+// должны быть литеральными типами с конструктором по умолчанию.
+template <typename Left, typename Right, std::size_t N,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+class static_bimap
+    : public sorted_bimap<static_bimap<Left, Right, N, CompareLeft,
+                                       CompareRight>,
+                          Left, Right, CompareLeft, CompareRight> {
+  using base = sorted_bimap<static_bimap, Left, Right, CompareLeft,
+                            CompareRight>;
+  friend base;
+
+public:
+  constexpr explicit static_bimap(
+      std::pair<Left, Right> const (&pairs)[N],
+      CompareLeft compare_left = CompareLeft(),
+      CompareRight compare_right = CompareRight())
+      : base(std::move(compare_left), std::move(compare_right)) {
+    std::array<std::size_t, N> by_left{};
+    std::array<std::size_t, N> by_right{};
+    for (std::size_t i = 0; i < N; i++) {
+      by_left[i] = by_right[i] = i;
+    }
+    sort(by_left, [&](std::size_t a, std::size_t b) {
+      return this->compare_left(pairs[a].first, pairs[b].first);
+    });
+    sort(by_right, [&](std::size_t a, std::size_t b) {
+      return this->compare_right(pairs[a].second, pairs[b].second);
+    });
+
+    // Позиция пары в lefts по ее номеру в pairs
+    std::array<std::size_t, N> left_position{};
+    for (std::size_t i = 0; i < N; i++) {
+      lefts[i] = pairs[by_left[i]].first;
+      left_position[by_left[i]] = i;
+    }
+    for (std::size_t i = 0; i < N; i++) {
+      rights[i] = pairs[by_right[i]].second;
+      right_to_left[i] = left_position[by_right[i]];
+      left_to_right[right_to_left[i]] = i;
+    }
+
+    for (std::size_t i = 1; i < N; i++) {
+      if (!this->compare_left(lefts[i - 1], lefts[i])) {
+        throw std::invalid_argument("static_bimap: duplicate left");
+      }
+      if (!this->compare_right(rights[i - 1], rights[i])) {
+        throw std::invalid_argument("static_bimap: duplicate right");
+      }
+    }
+  }
+
+  constexpr std::size_t size() const {
+    return N;
+  }
+
+private:
+  // Пирамидальная сортировка: std::sort не constexpr в libstdc++ 9 и
+  // libc++ 10, а вставками на больших таблицах долго даже при компиляции.
+  template <typename Less>
+  static constexpr void sort(std::array<std::size_t, N>& items, Less less) {
+    // std::swap тоже не constexpr в этих библиотеках
+    auto swap = [&](std::size_t a, std::size_t b) {
+      std::size_t tmp = items[a];
+      items[a] = items[b];
+      items[b] = tmp;
+    };
+    auto sift_down = [&](std::size_t root, std::size_t end) {
+      while (2 * root + 1 < end) {
+        std::size_t child = 2 * root + 1;
+        if (child + 1 < end && less(items[child], items[child + 1])) {
+          child++;
+        }
+        if (!less(items[root], items[child])) {
+          return;
+        }
+        swap(root, child);
+        root = child;
+      }
+    };
+    for (std::size_t i = N / 2; i-- > 0;) {
+      sift_down(i, N);
+    }
+    for (std::size_t end = N; end > 1; end--) {
+      swap(0, end - 1);
+      sift_down(0, end - 1);
+    }
+  }
+
+  template <bool IsLeft>
+  constexpr auto const* values() const {
+    if constexpr (IsLeft) {
+      return lefts.data();
+    } else {
+      return rights.data();
+    }
+  }
+
+  template <bool IsLeft>
+  constexpr std::size_t const* paired() const {
+    return IsLeft ? left_to_right.data() : right_to_left.data();
+  }
+
+  std::array<Left, N> lefts{};
+  std::array<Right, N> rights{};
+  std::array<std::size_t, N> left_to_right{};
+  std::array<std::size_t, N> right_to_left{};
+};
+
+// Left и Right задаются явно, N выводится из списка пар
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>, std::size_t N>
+constexpr static_bimap<Left, Right, N, CompareLeft, CompareRight>
+make_static_bimap(std::pair<Left, Right> const (&pairs)[N],
+                  CompareLeft compare_left = CompareLeft(),
+                  CompareRight compare_right = CompareRight()) {
+  return static_bimap<Left, Right, N, CompareLeft, CompareRight>(
+      pairs, std::move(compare_left), std::move(compare_right));
+}
@@ -1,7 +1,20 @@
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <numeric>
 #include <random>
+#include <sstream>
+#include <thread>
 
 #include "bimap.h"
+#include "mapped-bimap.h"
+#include "static-bimap.h"
 #include "test-classes.h"
+#include "traced-bimap.h"
 
 TEST(bimap, leak_check) {
   bimap<unsigned long, unsigned long> b;
@@ -66,6 +79,50 @@ TEST(bimap, copies) {
   EXPECT_NE(b.find_right(-10), b.end_right());
 }
 
+TEST(bimap, move_keeps_comparators) {
+  using function_bimap =
+      bimap<int, int, std::function<bool(int, int)>, std::greater<int>>;
+  static_assert(std::is_nothrow_move_constructible_v<bimap<int, int>>);
+  static_assert(!std::is_nothrow_move_constructible_v<function_bimap>);
+
+  function_bimap a(std::greater<int>{});
+  a.insert(1, 1);
+  a.insert(2, 2);
+  function_bimap b = std::move(a);
+  EXPECT_TRUE(a.empty());
+  // Перемещенный bimap пуст, но по-прежнему пригоден
+  a.insert(3, 3);
+  a.insert(4, 4);
+  EXPECT_EQ(*a.begin_left(), 4);
+  b = std::move(a);
+  EXPECT_EQ(*b.begin_left(), 4);
+  a.insert(5, 5);
+  EXPECT_EQ(a.at_left(5), 5);
+}
+
+TEST(bimap, copy_without_comparisons) {
+  using stats_bimap = bimap<int, int, std::less<int>, std::less<int>,
+                            bimap_policy::collect_stats>;
+  stats_bimap a;
+  for (int i = 0; i < 1000; i++) {
+    a.insert(i * 31 % 1000, i);
+  }
+  stats_bimap b = a;
+  EXPECT_EQ(b.stats().left.comparisons, 0);
+  EXPECT_EQ(b.stats().right.comparisons, 0);
+  EXPECT_EQ(b.stats().allocations, 1000);
+  EXPECT_EQ(b.stats().left.max_depth, a.stats().left.max_depth);
+  EXPECT_EQ(b.size(), 1000);
+  for (auto it = a.begin_right(), bit = b.begin_right(); it != a.end_right();
+       ++it, ++bit) {
+    EXPECT_EQ(*it, *bit);
+    EXPECT_EQ(*it.flip(), *bit.flip());
+  }
+  b.erase_left(5);
+  b.insert(5, 1000);
+  EXPECT_EQ(b.at_right(1000), 5);
+}
+
 TEST(bimap, throwing_in_copy_assignment) {
   {
     bimap<address_checking_object, int> a;
@@ -167,6 +224,70 @@ TEST(bimap, at_or_default) {
   EXPECT_EQ(b.at_left(0), 1000);
 }
 
+TEST(bimap, insert_or_assign) {
+  bimap<int, std::string> b;
+  auto [it, status, evicted] = b.insert_or_assign_left(1, "a");
+  EXPECT_EQ(*it, 1);
+  EXPECT_EQ(status, bimap_upsert::inserted);
+  EXPECT_FALSE(evicted);
+
+  b.insert(2, "b");
+  b.insert(3, "c");
+  auto result = b.insert_or_assign_left(1, "z");
+  EXPECT_EQ(result.status, bimap_upsert::assigned);
+  EXPECT_FALSE(result.evicted);
+  EXPECT_EQ(b.at_right("z"), 1);
+  EXPECT_EQ(b.find_right("a"), b.end_right());
+
+  result = b.insert_or_assign_left(1, "b");
+  EXPECT_EQ(result.status, bimap_upsert::assigned);
+  EXPECT_TRUE(result.evicted);
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(b.at_left(1), "b");
+  EXPECT_EQ(b.find_left(2), b.end_left());
+
+  auto right_result = b.insert_or_assign_right("c", 4);
+  EXPECT_EQ(right_result.status, bimap_upsert::assigned);
+  EXPECT_EQ(*right_result.position, "c");
+  EXPECT_EQ(b.at_left(4), "c");
+
+  right_result = b.insert_or_assign_right("c", 4);
+  EXPECT_EQ(right_result.status, bimap_upsert::found);
+  EXPECT_EQ(b.size(), 2);
+}
+
+TEST(bimap, try_emplace) {
+  using stats_bimap =
+      bimap<int, std::string, std::less<int>, std::less<std::string>,
+            bimap_policy::collect_stats>;
+  stats_bimap b;
+  b.insert(1, "aaa");
+  b.insert(2, "bb");
+
+  auto result = b.try_emplace_left(1, 5, 'x');
+  EXPECT_EQ(result.status, bimap_upsert::found);
+  EXPECT_EQ(*result.position.flip(), "aaa");
+
+  result = b.try_emplace_left(3, 5, 'x');
+  EXPECT_EQ(result.status, bimap_upsert::inserted);
+  EXPECT_FALSE(result.evicted);
+  EXPECT_EQ(b.at_left(3), "xxxxx");
+
+  b.reset_stats();
+  result = b.try_emplace_left(4, 3, 'a');
+  EXPECT_EQ(result.status, bimap_upsert::inserted);
+  EXPECT_TRUE(result.evicted);
+  EXPECT_EQ(b.size(), 3);
+  EXPECT_EQ(b.at_right("aaa"), 4);
+  EXPECT_EQ(b.find_left(1), b.end_left());
+  EXPECT_EQ(b.stats().allocations, 0);
+  EXPECT_EQ(b.stats().deallocations, 0);
+
+  auto right_result = b.try_emplace_right("new");
+  EXPECT_EQ(right_result.status, bimap_upsert::inserted);
+  EXPECT_EQ(b.at_left(0), "new");
+}
+
 TEST(bimap, end_flip) {
   bimap<int, int> b;
   EXPECT_EQ(b.end_left().flip(), b.end_right());
@@ -348,6 +469,49 @@ TEST(bimap, moving) {
   } // `a` and `b` should be destroyed correctly
 }
 
+TEST(bimap, moving_keeps_structure) {
+  using small_bimap = bimap<int, int, std::less<int>, std::less<int>,
+                            bimap_policy::small_buffer<2>>;
+  small_bimap a;
+  for (int i = 0; i < 100; i++) {
+    a.insert(i, -i);
+  }
+  auto it = a.find_left(50);
+  small_bimap b = std::move(a);
+  EXPECT_TRUE(a.empty());
+  EXPECT_EQ(a.begin_left(), a.end_left());
+  EXPECT_EQ(b.size(), 100);
+  EXPECT_EQ(*it.flip(), -50);
+  EXPECT_EQ(b.find_left(50), it);
+  EXPECT_EQ(b.at_right(-1), 1);
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  EXPECT_EQ(*--b.end_left(), 99);
+
+  a.insert(1, 1);
+  a = std::move(b);
+  EXPECT_EQ(a.size(), 100);
+  EXPECT_EQ(a.at_right(-99), 99);
+  a.erase_left(a.begin_left(), a.find_left(90));
+  b = a;
+  EXPECT_EQ(b.size(), 10);
+  EXPECT_EQ(*b.begin_right().flip(), 99);
+}
+
+TEST(bimap, assignment_keeps_comparators) {
+  using vec = std::pair<int, int>;
+  using vec_bimap = bimap<vec, int, vector_compare>;
+  vec_bimap a(vector_compare(vector_compare::manhattan));
+  a.insert({3, 3}, 1);
+  a.insert({0, 5}, 2);
+  vec_bimap b;
+  b = a;
+  EXPECT_EQ(*b.begin_left(), vec(0, 5));
+  vec_bimap c;
+  c = std::move(b);
+  EXPECT_EQ(*c.begin_left(), vec(0, 5));
+  EXPECT_EQ(c.at_left({5, 0}), 2);
+}
+
 /* Lev said that non-copyable comparator is ok here. */
 TEST(bimap, non_copyable_comparator) {
   class non_copyable_comparator : public std::less<int> {
@@ -384,6 +548,12 @@ TEST(bimap, equivalence) {
   b.insert(3, 2);
   EXPECT_NE(a, b);
 
+  b.erase_left(1);
+  b.erase_left(3);
+  b.insert(3, 4);
+  b.insert(1, 2);
+  EXPECT_EQ(a, b);
+
   EXPECT_EQ(a.end_left().flip(), a.end_right());
   EXPECT_EQ(a.end_right().flip(), a.end_left());
 }
@@ -443,6 +613,1002 @@ TEST(bimap, swap) {
   EXPECT_EQ(*b.find_right(3), 3);
 }
 
+TEST(bimap, compact) {
+  using stats_bimap =
+      bimap<int, std::string, std::less<int>, std::less<std::string>,
+            bimap_policy::collect_stats>;
+  stats_bimap b;
+  std::mt19937 e(1);
+  for (int i = 0; i < 5000; i++) {
+    b.insert(e() % 10000, std::to_string(e()));
+    b.erase_left(e() % 10000);
+  }
+  std::vector<std::pair<int, std::string>> before;
+  for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+    before.emplace_back(*it, *it.flip());
+  }
+
+  b.reset_stats();
+  b.compact();
+  EXPECT_EQ(b.stats().left.comparisons, 0);
+  EXPECT_EQ(b.stats().right.comparisons, 0);
+  EXPECT_EQ(b.stats().allocations, 1);
+  EXPECT_EQ(b.stats().deallocations, before.size());
+
+  std::vector<std::pair<int, std::string>> after;
+  int const* previous = nullptr;
+  for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+    after.emplace_back(*it, *it.flip());
+    if (previous != nullptr) {
+      EXPECT_LT(previous, &*it);
+    }
+    previous = &*it;
+  }
+  EXPECT_EQ(before, after);
+  EXPECT_EQ(b.at_right(before.front().second), before.front().first);
+
+  b.compact();
+  b.erase_left(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.stats().deallocations, b.stats().allocations + before.size());
+  b.insert(1, "1");
+  b.compact();
+  EXPECT_EQ(b.at_left(1), "1");
+}
+
+TEST(bimap, compact_set_algebra) {
+  bimap<int, std::string> result;
+  {
+    bimap<int, std::string> a, b;
+    for (int i = 0; i < 100; i++) {
+      a.insert(i, std::to_string(i));
+      b.insert(i + 50, std::to_string(i + 50));
+    }
+    // Узлы из блока compact остаются в b, результат получает копии
+    b.compact();
+    result = bimap_union(std::move(a), std::move(b));
+  }
+  EXPECT_EQ(result.size(), 150);
+  EXPECT_EQ(result.at_left(149), "149");
+  result.erase_left(result.begin_left(), result.end_left());
+  EXPECT_TRUE(result.empty());
+
+  bimap<int, std::string> a, b;
+  for (int i = 0; i < 100; i++) {
+    a.insert(i, std::to_string(i));
+    b.insert(i * 2, std::to_string(i * 2));
+  }
+  a.compact();
+  auto common = bimap_intersection(std::move(a), b);
+  a = bimap<int, std::string>();
+  EXPECT_EQ(common.size(), 50);
+  EXPECT_EQ(common.at_right("98"), 98);
+}
+
+TEST(bimap, slab_storage) {
+  using slab_bimap =
+      bimap<int, std::string, std::less<int>, std::less<std::string>,
+            bimap_policy::slab_storage, bimap_policy::collect_stats>;
+  slab_bimap b;
+  b.reserve(1000);
+  EXPECT_EQ(b.stats().allocations, 1);
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i, std::to_string(i));
+  }
+  EXPECT_EQ(b.stats().allocations, 1);
+
+  // Места удаленных пар занимают следующие вставки
+  b.erase_left(b.begin_left(), b.find_left(500));
+  for (int i = 1000; i < 1500; i++) {
+    b.insert(i, std::to_string(i));
+  }
+  EXPECT_EQ(b.stats().allocations, 1);
+  EXPECT_EQ(b.stats().deallocations, 0);
+
+  // Места кончились: новый блок на size() узлов
+  b.insert(-1, "-1");
+  EXPECT_EQ(b.stats().allocations, 2);
+  for (int i = 1500; i < 2499; i++) {
+    b.insert(i, std::to_string(i));
+  }
+  EXPECT_EQ(b.stats().allocations, 2);
+  b.reserve(10);
+  EXPECT_EQ(b.stats().allocations, 3);
+
+  slab_bimap copy = b;
+  EXPECT_EQ(copy.stats().allocations, 1);
+  EXPECT_TRUE(copy == b);
+
+  slab_bimap other;
+  other.insert(7, "seven");
+  other.swap(b);
+  EXPECT_EQ(other.at_left(-1), "-1");
+  EXPECT_EQ(b.at_right("seven"), 7);
+  b.insert(8, "eight");
+
+  other.compact();
+  EXPECT_EQ(other.stats().deallocations, 3);
+  EXPECT_EQ(other.size(), 2000);
+  EXPECT_EQ(other.at_left(2000), "2000");
+  other.erase_left(other.begin_left(), other.end_left());
+  other.compact();
+  EXPECT_EQ(other.stats().deallocations, 4);
+  other.insert(1, "1");
+  EXPECT_EQ(other.at_right("1"), 1);
+}
+
+TEST(bimap, slab_storage_set_algebra) {
+  using slab_bimap = bimap<int, int, std::less<int>, std::less<int>,
+                           bimap_policy::slab_storage>;
+  slab_bimap result;
+  {
+    slab_bimap a, b;
+    for (int i = 0; i < 100; i++) {
+      a.insert(i, i);
+      b.insert(i + 50, i + 50);
+    }
+    // Узлы операндов живут в их блоках и копируются в блоки результата
+    result = bimap_union(std::move(a), std::move(b));
+  }
+  EXPECT_EQ(result.size(), 150);
+  EXPECT_EQ(std::distance(result.begin_left(), result.end_left()), 150);
+  result.erase_left(result.begin_left(), result.find_left(100));
+  result.insert(-1, -1);
+
+  slab_bimap a, b;
+  for (int i = 0; i < 100; i++) {
+    a.insert(i, i);
+    b.insert(i * 2, i * 2);
+  }
+  auto common = bimap_intersection(std::move(a), b);
+  auto rest = bimap_difference(std::move(b), common);
+  a = slab_bimap();
+  b = slab_bimap();
+  EXPECT_EQ(common.size(), 50);
+  EXPECT_EQ(common.at_left(98), 98);
+  EXPECT_EQ(rest.size(), 50);
+  EXPECT_EQ(rest.at_right(100), 100);
+}
+
+TEST(bimap, detach) {
+  {
+    bimap<address_checking_object, int> b;
+    for (int i = 0; i < 1000; i++) {
+      b.insert(i, -i);
+    }
+    auto nodes = b.detach();
+    EXPECT_TRUE(b.empty());
+    EXPECT_EQ(b.begin_left(), b.end_left());
+    EXPECT_EQ(b.find_right(-5), b.end_right());
+    EXPECT_EQ(nodes.size(), 1000);
+
+    EXPECT_FALSE(nodes.reclaim(100));
+    EXPECT_GE(nodes.size(), 950);
+    std::size_t steps = 1;
+    while (!nodes.reclaim(1)) {
+      steps++;
+    }
+    EXPECT_LT(steps, 2000);
+    EXPECT_TRUE(nodes.empty());
+
+    b.insert(1, 1);
+    auto rest = b.detach();
+    EXPECT_EQ(rest.size(), 1);
+  }
+  address_checking_object::expect_no_instances();
+
+  // Разрушение в другом потоке
+  bimap<int, int, std::less<int>, std::less<int>, bimap_policy::small_buffer<4>,
+        bimap_policy::slab_storage, bimap_policy::radix_index>
+      b;
+  for (int i = 0; i < 10000; i++) {
+    b.insert(i, i * 2);
+  }
+  auto nodes = b.detach();
+  EXPECT_EQ(nodes.size(), 10000 - 4);
+  std::thread([nodes = std::move(nodes)]() mutable {
+    EXPECT_TRUE(nodes.reclaim(std::numeric_limits<std::size_t>::max()));
+  }).join();
+  EXPECT_TRUE(b.empty());
+  for (int i = 0; i < 10; i++) {
+    b.insert(i, -i);
+  }
+  EXPECT_EQ(b.at_left(7), -7);
+  EXPECT_EQ(*b.lower_bound_left(-3), 0);
+}
+
+TEST(bimap, diff_apply) {
+  bimap<int, int> a, b;
+  a.insert(1, 10);
+  a.insert(2, 20);
+  a.insert(3, 30);
+  a.insert(4, 40);
+  b.insert(2, 30);
+  b.insert(3, 20);
+  b.insert(4, 40);
+  b.insert(5, 10);
+
+  auto patch = diff(a, b);
+  EXPECT_EQ(patch.removed, std::vector<int>({1}));
+  EXPECT_EQ(patch.added, (std::vector<std::pair<int, int>>{{5, 10}}));
+  EXPECT_EQ(patch.rebound,
+            (std::vector<std::pair<int, int>>{{2, 30}, {3, 20}}));
+
+  a.apply(patch);
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(a.at_right(10), 5);
+  EXPECT_EQ(a.at_right(30), 2);
+  EXPECT_TRUE(diff(a, b).empty());
+}
+
+TEST(bimap, apply_conflicting_patch) {
+  bimap<int, int> a;
+  a.insert(1, 10);
+  a.insert(2, 20);
+
+  bimap_patch<int, int> patch;
+  patch.removed = {0};
+  patch.added = {{1, 30}, {3, 20}, {4, 40}};
+  patch.rebound = {{2, 10}};
+  a.apply(patch);
+
+  EXPECT_EQ(a.size(), 3);
+  EXPECT_EQ(a.at_left(1), 10);
+  EXPECT_EQ(a.find_left(2), a.end_left());
+  EXPECT_EQ(a.at_left(3), 20);
+  EXPECT_EQ(a.at_left(4), 40);
+}
+
+TEST(bimap, set_algebra) {
+  bimap<int, int> a, b;
+  a.insert(1, 10);
+  a.insert(2, 20);
+  a.insert(3, 30);
+  b.insert(1, 10);
+  b.insert(2, 25);
+  b.insert(4, 30);
+  b.insert(5, 50);
+
+  auto u = bimap_union(a, b);
+  EXPECT_EQ(u.size(), 4);
+  EXPECT_EQ(u.at_left(2), 20);
+  EXPECT_EQ(u.at_left(3), 30);
+  EXPECT_EQ(u.at_left(5), 50);
+
+  u = bimap_union(a, b, bimap_conflict::keep_second);
+  EXPECT_EQ(u.size(), 4);
+  EXPECT_EQ(u.at_left(2), 25);
+  EXPECT_EQ(u.at_left(4), 30);
+
+  u = bimap_union(a, b, bimap_conflict::drop);
+  EXPECT_EQ(u.size(), 2);
+  EXPECT_EQ(u.at_left(1), 10);
+  EXPECT_EQ(u.at_left(5), 50);
+
+  auto i = bimap_intersection(a, b);
+  EXPECT_EQ(i.size(), 1);
+  EXPECT_EQ(i.at_left(1), 10);
+  i = bimap_intersection(a, b, bimap_conflict::keep_first);
+  EXPECT_EQ(i, a);
+  i = bimap_intersection(a, b, bimap_conflict::keep_second);
+  EXPECT_EQ(i.size(), 3);
+  EXPECT_EQ(i.find_left(5), i.end_left());
+
+  auto d = bimap_difference(a, b);
+  EXPECT_TRUE(d.empty());
+  d = bimap_difference(a, b, bimap_conflict::keep_first);
+  EXPECT_EQ(d.size(), 2);
+  EXPECT_EQ(d.find_left(1), d.end_left());
+}
+
+TEST(bimap, set_algebra_reuses_nodes) {
+  bimap<int, int> a, b;
+  for (int i = 0; i < 1000; i++) {
+    a.insert(i * 2, i);
+    b.insert(i * 2 + 1, i + 1000);
+  }
+  int const* from_a = &*a.find_left(10);
+  int const* from_b = &*b.find_left(11);
+
+  auto u = bimap_union(std::move(a), std::move(b));
+  EXPECT_EQ(u.size(), 2000);
+  EXPECT_EQ(&*u.find_left(10), from_a);
+  EXPECT_EQ(&*u.find_left(11), from_b);
+  EXPECT_EQ(u.at_right(1999), 1999);
+
+  auto i = bimap_intersection(bimap<int, int>(u), std::move(u),
+                              bimap_conflict::keep_second);
+  EXPECT_EQ(i.size(), 2000);
+  EXPECT_EQ(&*i.find_left(10), from_a);
+}
+
+template <>
+struct bimap_serializer<test_object> {
+  static void save(std::ostream& out, test_object const& value) {
+    bimap_serializer<int>::save(out, value.a);
+  }
+  static test_object load(std::istream& in) {
+    return test_object(bimap_serializer<int>::load(in));
+  }
+};
+
+TEST(bimap, save_load) {
+  bimap<int, int> b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i * 7 % 1000, i * 13 % 1000);
+  }
+  std::stringstream stream;
+  b.save(stream);
+
+  bimap<int, int> loaded;
+  loaded.insert(-1, -1);
+  loaded.load(stream);
+  EXPECT_EQ(loaded.size(), b.size());
+  auto it = b.begin_left();
+  for (auto lit = loaded.begin_left(); lit != loaded.end_left(); ++lit, ++it) {
+    EXPECT_EQ(*lit, *it);
+    EXPECT_EQ(*lit.flip(), *it.flip());
+  }
+  auto rit = b.begin_right();
+  for (auto lit = loaded.begin_right(); lit != loaded.end_right();
+       ++lit, ++rit) {
+    EXPECT_EQ(*lit, *rit);
+  }
+  EXPECT_EQ(loaded.at_right(13), 7);
+  loaded.insert(1000, 1000);
+  EXPECT_EQ(loaded.size(), 1001);
+}
+
+TEST(bimap, save_load_custom_serializer) {
+  bimap<std::string, test_object, std::greater<>> b;
+  b.insert("one", test_object(1));
+  b.insert("two", test_object(2));
+  b.insert("three", test_object(3));
+  std::stringstream stream;
+  b.save(stream);
+
+  bimap<std::string, test_object, std::greater<>> loaded;
+  loaded.load(stream);
+  EXPECT_EQ(loaded.size(), 3);
+  EXPECT_EQ(*loaded.begin_left(), "two");
+  EXPECT_EQ(*loaded.begin_right(), test_object(1));
+  EXPECT_EQ(loaded.at_left("three"), test_object(3));
+}
+
+TEST(bimap, load_broken_snapshot) {
+  bimap<int, int> b;
+  b.insert(1, 2);
+  b.insert(2, 1);
+  std::stringstream stream;
+  b.save(stream);
+  std::string data = stream.str();
+
+  bimap<int, int> loaded;
+  loaded.insert(5, 5);
+  std::stringstream truncated(data.substr(0, data.size() - 1));
+  EXPECT_THROW(loaded.load(truncated), std::runtime_error);
+  data.replace(data.size() - 8, 8, data.substr(data.size() - 16, 8));
+  std::stringstream repeated_index(data);
+  EXPECT_THROW(loaded.load(repeated_index), std::runtime_error);
+  EXPECT_EQ(loaded.size(), 1);
+  EXPECT_EQ(loaded.at_left(5), 5);
+}
+
+#ifdef BIMAP_HAS_FD_STREAMS
+TEST(bimap, save_load_fd) {
+  bimap<int, int> b;
+  b.insert(1, 3);
+  b.insert(2, 2);
+  b.insert(3, 1);
+  FILE* file = std::tmpfile();
+  ASSERT_NE(file, nullptr);
+  b.save(fileno(file));
+  std::rewind(file);
+  bimap<int, int> loaded;
+  loaded.load(fileno(file));
+  std::fclose(file);
+  EXPECT_EQ(loaded.size(), 3);
+  EXPECT_EQ(*loaded.begin_right().flip(), 3);
+}
+#endif
+
+TEST(bimap, stats) {
+  bimap<int, int, std::less<int>, std::less<int>, bimap_policy::collect_stats>
+      b;
+  EXPECT_EQ(b.stats().allocations, 0);
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, -i);
+  }
+  b.erase_left(50);
+  auto stats = b.stats();
+  EXPECT_EQ(stats.allocations, 100);
+  EXPECT_EQ(stats.deallocations, 1);
+  EXPECT_GT(stats.left.comparisons, 0);
+  EXPECT_GT(stats.left.rotations, 0);
+  EXPECT_GT(stats.right.rotations, 0);
+  EXPECT_GE(stats.left.max_depth, 7);
+  EXPECT_LE(stats.left.max_depth, 9);
+  EXPECT_GT(stats.right.average_depth, 1);
+  EXPECT_LT(stats.right.average_depth, stats.right.max_depth);
+
+  b.reset_stats();
+  EXPECT_EQ(b.stats().left.comparisons, 0);
+  b.find_left(10);
+  EXPECT_GT(b.stats().left.comparisons, 0);
+  EXPECT_EQ(b.stats().right.comparisons, 0);
+  EXPECT_EQ(b.stats().allocations, 0);
+  EXPECT_EQ(b.stats().left.max_depth, stats.left.max_depth);
+
+  static_assert(sizeof(bimap<int, int>) ==
+                sizeof(std::size_t) + 2 * sizeof(intrusive::set_element_base) +
+                    sizeof(void*));
+}
+
+TEST(bimap, rebalance_stops_early) {
+  bimap<int, int, std::less<int>, std::less<int>, bimap_policy::collect_stats>
+      b;
+  size_t const count = 10000;
+  std::vector<int> lefts(count);
+  std::iota(lefts.begin(), lefts.end(), 0);
+  std::shuffle(lefts.begin(), lefts.end(), std::mt19937(count));
+  for (size_t i = 0; i < count; i++) {
+    b.insert(lefts[i], i);
+  }
+  // Без ранней остановки каждая операция проходит весь путь до корня
+  auto stats = b.stats();
+  EXPECT_LT(stats.left.rebalance_steps, 4 * count);
+  EXPECT_LT(stats.right.rebalance_steps, 4 * count);
+  EXPECT_LE(stats.left.max_depth, 19);
+
+  b.reset_stats();
+  for (size_t i = 0; i < count; i += 2) {
+    b.erase_right(i);
+  }
+  stats = b.stats();
+  EXPECT_LT(stats.right.rebalance_steps, 4 * count / 2);
+  EXPECT_LE(stats.left.max_depth, 18);
+  EXPECT_LE(stats.right.max_depth, 18);
+  EXPECT_EQ(b.size(), count / 2);
+  EXPECT_EQ(b.at_right(1), lefts[1]);
+}
+
+TEST(bimap, small_buffer) {
+  using small_bimap = bimap<int, std::string, std::less<int>,
+                            std::less<std::string>,
+                            bimap_policy::small_buffer<4>,
+                            bimap_policy::collect_stats>;
+  small_bimap a;
+  for (int i = 0; i < 4; i++) {
+    a.insert(i, std::to_string(i));
+  }
+  EXPECT_EQ(a.stats().allocations, 0);
+  a.erase_left(1);
+  a.insert(10, "10");
+  EXPECT_EQ(a.stats().allocations, 0);
+  a.insert(20, "20");
+  a.insert(30, "30");
+  EXPECT_EQ(a.stats().allocations, 2);
+
+  small_bimap b;
+  b.insert(-1, "-1");
+  a.swap(b);
+  EXPECT_EQ(a.size(), 1);
+  EXPECT_EQ(b.size(), 6);
+  EXPECT_EQ(a.at_left(-1), "-1");
+  std::vector<int> lefts;
+  for (auto it = b.begin_right(); it != b.end_right(); ++it) {
+    lefts.push_back(*it.flip());
+  }
+  EXPECT_EQ(lefts, (std::vector<int>{0, 10, 2, 20, 3, 30}));
+  b.erase_left(b.begin_left(), b.end_left());
+  a.swap(b);
+  EXPECT_TRUE(a.empty());
+  EXPECT_EQ(b.at_right("-1"), -1);
+
+  small_bimap c = b;
+  EXPECT_EQ(c.at_left(-1), "-1");
+}
+
+TEST(bimap, string_key_prefix) {
+  bimap<std::string, int, std::less<std::string>, std::less<int>,
+        bimap_policy::collect_stats>
+      b;
+  for (int i = 0; i < 1000; i++) {
+    auto digits = std::to_string(i);
+    b.insert("key" + std::string(3 - digits.size(), '0') + digits, i);
+  }
+  // Ключи различаются в первых 8 байтах, компаратор нужен только на
+  // найденном узле
+  b.reset_stats();
+  EXPECT_EQ(b.at_left("key500"), 500);
+  EXPECT_EQ(b.stats().left.comparisons, 2);
+
+  // Общий префикс длиннее 8 байт, нулевые и старшие байты
+  std::vector<std::string> keys = {"",
+                                   std::string(1, '\0'),
+                                   std::string("a\0", 2),
+                                   "a",
+                                   "abcdefgh",
+                                   "abcdefgh1",
+                                   "abcdefgh0",
+                                   "abcdefg\xff",
+                                   "\x80",
+                                   "\x7f"};
+  bimap<std::string, int> c;
+  for (size_t i = 0; i < keys.size(); i++) {
+    c.insert(keys[i], i);
+  }
+  std::sort(keys.begin(), keys.end());
+  auto it = c.begin_left();
+  for (auto const& key : keys) {
+    EXPECT_EQ(*it++, key);
+    EXPECT_NE(c.find_left(key), c.end_left());
+  }
+  EXPECT_EQ(c.find_left("abcdefgh2"), c.end_left());
+
+  // Смена ключа на месте обновляет префикс
+  c.insert_or_assign_right(4, "\xffz");
+  EXPECT_EQ(c.at_left("\xffz"), 4);
+  EXPECT_EQ(*--c.end_left(), "\xffz");
+  EXPECT_EQ(c.find_left("abcdefgh"), c.end_left());
+}
+
+namespace {
+
+// Считает вызовы, чтобы проверить, что хранимые ключи не проецируются
+struct squared_norm {
+  static inline std::size_t calls = 0;
+
+  long long operator()(std::pair<int, int> v) const {
+    calls++;
+    return 1ll * v.first * v.first + 1ll * v.second * v.second;
+  }
+};
+
+} // namespace
+
+TEST(bimap, by_projection) {
+  bimap<std::pair<int, int>, int, by_projection<squared_norm>> b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert({i, -i}, i);
+  }
+  // Та же норма, что у (3, -3)
+  EXPECT_EQ(b.insert({-3, 3}, 5000), b.end_left());
+
+  squared_norm::calls = 0;
+  EXPECT_EQ(b.at_left({-500, 500}), 500);
+  EXPECT_EQ(squared_norm::calls, 1);
+  squared_norm::calls = 0;
+  EXPECT_EQ(b.lower_bound_left({3, 4})->first, 4);
+  EXPECT_EQ(squared_norm::calls, 1);
+  EXPECT_EQ(b.find_left({1, 2}), b.end_left());
+
+  // Смена ключа пересчитывает проекцию
+  b.insert_or_assign_right(10, std::make_pair(2000, 0));
+  EXPECT_EQ(b.find_left({10, -10}), b.end_left());
+  EXPECT_EQ(*(--b.end_left()), std::make_pair(2000, 0));
+  EXPECT_EQ(b.at_left({0, -2000}), 10);
+
+  auto copy = b;
+  EXPECT_EQ(copy.at_left({-999, 999}), 999);
+  auto by_norm = [](auto const& x, auto const& y) {
+    return squared_norm()(x) < squared_norm()(y);
+  };
+  EXPECT_TRUE(std::is_sorted(copy.begin_left(), copy.end_left(), by_norm));
+}
+
+TEST(bimap, payload) {
+  using payload_bimap =
+      bimap<int, std::string, std::less<int>, std::less<std::string>,
+            bimap_policy::small_buffer<4>, bimap_policy::payload<int>>;
+  payload_bimap b;
+  for (int i = 0; i < 10; i++) {
+    b.insert(i, std::to_string(i)).payload() = i * 100;
+  }
+  EXPECT_EQ(b.find_left(3).payload(), 300);
+  EXPECT_EQ(b.find_right("7").payload(), 700);
+  b.find_right("5").payload()++;
+  EXPECT_EQ(b.find_left(5).flip().payload(), 501);
+  EXPECT_EQ(b.insert(20, "20").payload(), 0);
+
+  // Смена right оставляет payload пары, вытесненная пара его уносит
+  b.insert_or_assign_left(1, "one");
+  EXPECT_EQ(b.find_right("one").payload(), 100);
+  b.insert_or_assign_left(30, "2");
+  EXPECT_EQ(b.find_left(30).payload(), 0);
+
+  auto copy = b;
+  EXPECT_EQ(copy.find_left(9).payload(), 900);
+  payload_bimap small;
+  small.insert(-1, "-1").payload() = -100;
+  small.swap(copy);
+  EXPECT_EQ(small.find_right("8").payload(), 800);
+  EXPECT_EQ(copy.find_left(-1).payload(), -100);
+  small.compact();
+  EXPECT_EQ(small.find_left(4).payload(), 400);
+
+  auto both = bimap_union(small, std::move(copy));
+  EXPECT_EQ(both.find_left(-1).payload(), -100);
+  EXPECT_EQ(both.find_left(6).payload(), 600);
+
+  std::stringstream stream;
+  both.save(stream);
+  payload_bimap loaded;
+  loaded.load(stream);
+  EXPECT_EQ(loaded, both);
+  EXPECT_EQ(loaded.find_right("5").payload(), 501);
+  stream.seekg(0);
+  bimap<int, std::string> plain;
+  EXPECT_THROW(plain.load(stream), std::runtime_error);
+}
+
+TEST(bimap, lookup_cache) {
+  using cached_bimap = bimap<int, std::string, std::less<int>,
+                             std::less<std::string>,
+                             bimap_policy::lookup_cache<16>>;
+  cached_bimap b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, std::to_string(i));
+  }
+  b.reset_cache_stats();
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(b.at_left(7), "7");
+    EXPECT_EQ(b.at_right("42"), 42);
+  }
+  EXPECT_EQ(b.cache_stats().left.misses, 1);
+  EXPECT_EQ(b.cache_stats().left.hits, 9);
+  EXPECT_EQ(b.cache_stats().right.hits, 9);
+  // 23 попадает в слот 7 и вытесняет его
+  EXPECT_EQ(b.at_left(23), "23");
+  EXPECT_EQ(b.at_left(7), "7");
+  EXPECT_EQ(b.cache_stats().left.misses, 3);
+
+  EXPECT_TRUE(b.erase_left(7));
+  EXPECT_EQ(b.find_left(7), b.end_left());
+  b.insert_or_assign_left(42, "forty two");
+  EXPECT_EQ(b.find_right("42"), b.end_right());
+  EXPECT_EQ(b.at_right("forty two"), 42);
+  b.insert_or_assign_right("forty two", 43);
+  EXPECT_EQ(b.find_left(42), b.end_left());
+  EXPECT_EQ(b.at_left(43), "forty two");
+
+  cached_bimap moved = std::move(b);
+  EXPECT_EQ(b.find_left(43), b.end_left());
+  EXPECT_EQ(moved.at_left(43), "forty two");
+  moved.compact();
+  EXPECT_EQ(moved.at_right("forty two"), 43);
+  EXPECT_EQ(*moved.find_left(43).flip(), "forty two");
+
+  auto merged = bimap_union(std::move(moved), cached_bimap());
+  EXPECT_EQ(moved.find_left(43), moved.end_left());
+  EXPECT_EQ(merged.at_left(43), "forty two");
+}
+
+namespace {
+
+struct case_insensitive_less {
+  bool operator()(std::string const& a, std::string const& b) const {
+    return std::lexicographical_compare(
+        a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+          return std::tolower(static_cast<unsigned char>(x)) <
+                 std::tolower(static_cast<unsigned char>(y));
+        });
+  }
+};
+
+} // namespace
+
+TEST(bimap, lookup_cache_equivalent_keys) {
+  // "ABC" и "abc" эквивалентны, но попадают в разные слоты
+  bimap<std::string, int, case_insensitive_less, std::less<int>,
+        bimap_policy::lookup_cache<16>>
+      b;
+  b.insert("abc", 1);
+  EXPECT_EQ(b.at_left("ABC"), 1);
+  EXPECT_TRUE(b.erase_left("abc"));
+  EXPECT_EQ(b.find_left("ABC"), b.end_left());
+  b.insert("Abc", 2);
+  EXPECT_EQ(b.at_left("ABC"), 2);
+  EXPECT_EQ(b.at_left("abc"), 2);
+}
+
+TEST(bimap, radix_index) {
+  // Индекс есть только у левой стороны
+  using indexed_bimap = bimap<std::int64_t, std::string, std::less<>,
+                              std::less<std::string>,
+                              bimap_policy::radix_index>;
+  indexed_bimap b;
+  std::int64_t keys[] = {std::numeric_limits<std::int64_t>::min(),
+                         -1000000000000, -256, -1, 0, 1, 255, 256, 65536,
+                         std::numeric_limits<std::int64_t>::max()};
+  for (auto key : keys) {
+    b.insert(key, std::to_string(key));
+  }
+  EXPECT_TRUE(std::equal(b.begin_left(), b.end_left(), std::begin(keys),
+                         std::end(keys)));
+  EXPECT_EQ(b.at_left(-256), "-256");
+  EXPECT_EQ(b.find_left(-255), b.end_left());
+  EXPECT_EQ(*b.lower_bound_left(-255), -1);
+  EXPECT_EQ(*b.lower_bound_left(257), 65536);
+  EXPECT_EQ(*b.upper_bound_left(256), 65536);
+  EXPECT_EQ(*b.lower_bound_left(-2000000000000), -1000000000000);
+  EXPECT_EQ(b.upper_bound_left(std::numeric_limits<std::int64_t>::max()),
+            b.end_left());
+  EXPECT_EQ(*b.lower_bound_left(0).flip(), "0");
+
+  EXPECT_TRUE(b.erase_left(256));
+  EXPECT_EQ(*b.lower_bound_left(256), 65536);
+  b.insert_or_assign_right("1", 300);
+  EXPECT_EQ(b.find_left(1), b.end_left());
+  EXPECT_EQ(b.at_left(300), "1");
+
+  // Все 256 ключей одного байта: узлы растут до node256 и сжимаются обратно
+  bimap<std::uint8_t, int, std::less<std::uint8_t>, std::less<int>,
+        bimap_policy::radix_index>
+      bytes;
+  for (int i = 0; i < 256; i++) {
+    bytes.insert(static_cast<std::uint8_t>(i * 7), i);
+  }
+  for (int i = 0; i < 256; i++) {
+    EXPECT_EQ(bytes.at_left(static_cast<std::uint8_t>(i * 7)), i);
+  }
+  for (int i = 0; i < 256; i += 2) {
+    EXPECT_TRUE(bytes.erase_left(static_cast<std::uint8_t>(i)));
+  }
+  EXPECT_EQ(*bytes.lower_bound_left(10), 11);
+  bytes.erase_left(bytes.begin_left(), bytes.find_left(201));
+  EXPECT_EQ(*bytes.begin_left(), 201);
+  EXPECT_EQ(bytes.find_left(199), bytes.end_left());
+  EXPECT_EQ(*bytes.lower_bound_left(0), 201);
+  bytes.erase_right(bytes.begin_right(), bytes.end_right());
+  EXPECT_TRUE(bytes.empty());
+  bytes.insert(5, 5);
+  EXPECT_EQ(bytes.at_right(5), 5);
+}
+
+TEST(bimap, erase_if) {
+  bimap<int, int, std::less<int>, std::less<int>, bimap_policy::collect_stats>
+      b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i, (i * 37) % 1000);
+  }
+
+  // Мало совпадений - удаление по одной паре
+  EXPECT_EQ(erase_if(b, [](int left, int) { return left % 100 == 0; }), 10);
+  EXPECT_EQ(b.size(), 990);
+  EXPECT_EQ(b.find_left(500), b.end_left());
+  EXPECT_EQ(b.find_right(0), b.end_right());
+
+  // Треть пар - перестройка обоих деревьев без поворотов
+  b.reset_stats();
+  EXPECT_EQ(erase_if(b, [](int, int right) { return right % 3 == 0; }), 330);
+  EXPECT_EQ(b.stats().left.rotations, 0);
+  EXPECT_EQ(b.stats().right.rotations, 0);
+  EXPECT_EQ(b.size(), 660);
+  EXPECT_EQ(std::distance(b.begin_left(), b.end_left()), 660);
+  EXPECT_EQ(std::distance(b.begin_right(), b.end_right()), 660);
+  for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+    EXPECT_NE(*it % 100, 0);
+    EXPECT_NE(*it.flip() % 3, 0);
+    EXPECT_EQ(*it.flip(), (*it * 37) % 1000);
+    EXPECT_EQ(b.find_right(*it.flip()).flip(), it);
+  }
+  b.insert(0, 0);
+  EXPECT_EQ(b.at_right(0), 0);
+
+  // Бросающий предикат ничего не удаляет
+  EXPECT_THROW(erase_if(b,
+                        [](int left, int) {
+                          if (left == 502) {
+                            throw std::runtime_error("stop");
+                          }
+                          return true;
+                        }),
+               std::runtime_error);
+  EXPECT_EQ(b.size(), 661);
+
+  EXPECT_EQ(erase_if(b, [](int, int) { return true; }), 661);
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.begin_right(), b.end_right());
+}
+
+TEST(bimap, parallel_scan) {
+  bimap<int, std::string> b;
+  int const n = 100000;
+  for (int i = 0; i < n; i++) {
+    b.insert(i, std::to_string(n - i));
+  }
+  bimap_execution::parallel_policy par{4};
+
+  std::atomic<long long> sum{0};
+  b.for_each_left(par, [&](int left, std::string const& right) {
+    EXPECT_EQ(right, std::to_string(n - left));
+    sum += left;
+  });
+  EXPECT_EQ(sum, static_cast<long long>(n) * (n - 1) / 2);
+
+  // Некоммутативная свертка: конкатенация последних цифр по порядку
+  auto concat = [](std::string a, std::string const& b) {
+    a += b;
+    return a;
+  };
+  auto last_digit = [](int left, std::string const&) {
+    return std::to_string(left % 10);
+  };
+  auto sequential = b.reduce_left(bimap_execution::seq, std::string("^"),
+                                  concat, last_digit);
+  EXPECT_EQ(sequential.size(), n + 1);
+  EXPECT_EQ(b.reduce_left(par, std::string("^"), concat, last_digit),
+            sequential);
+  auto by_right = b.reduce_right(
+      par, std::string(), concat,
+      [](int, std::string const& right) { return right.substr(0, 1); });
+  EXPECT_EQ(by_right, b.reduce_right(bimap_execution::seq, std::string(),
+                                     concat, [](int, std::string const& r) {
+                                       return r.substr(0, 1);
+                                     }));
+
+  std::atomic<int> visited{0};
+  EXPECT_THROW(b.for_each_right(par,
+                                [&](int left, std::string const&) {
+                                  visited++;
+                                  if (left == n / 2) {
+                                    throw std::runtime_error("stop");
+                                  }
+                                }),
+               std::runtime_error);
+  EXPECT_GT(visited, 0);
+
+  bimap<int, int> empty;
+  EXPECT_EQ(empty.reduce_left(par, 7, std::plus<>(),
+                              [](int l, int r) { return l + r; }),
+            7);
+}
+
+TEST(mapped_bimap, queries) {
+  bimap<int, double, std::greater<>> b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, (i * 37 % 100) / 2.0);
+  }
+  std::stringstream stream;
+  mapped_bimap<int, double, std::greater<>>::write(stream, b);
+  std::string data = stream.str();
+  std::vector<std::max_align_t> image(data.size() / sizeof(std::max_align_t) +
+                                      1);
+  std::memcpy(image.data(), data.data(), data.size());
+
+  mapped_bimap<int, double, std::greater<>> m(image.data(), data.size());
+  EXPECT_EQ(m.size(), 100);
+  EXPECT_EQ(*m.begin_left(), 99);
+  EXPECT_EQ(m.at_left(1), 18.5);
+  EXPECT_EQ(m.at_right(18.5), 1);
+  EXPECT_EQ(m.find_left(100), m.end_left());
+  EXPECT_EQ(m.find_right(0.25), m.end_right());
+  EXPECT_EQ(*m.lower_bound_left(200), 99);
+  EXPECT_EQ(*m.upper_bound_left(50), 49);
+  EXPECT_EQ(*m.lower_bound_right(0.1), 0.5);
+  EXPECT_EQ(m.upper_bound_right(49.5), m.end_right());
+  EXPECT_EQ(m.end_left().flip(), m.end_right());
+
+  auto it = b.begin_left();
+  for (auto mit = m.begin_left(); mit != m.end_left(); ++mit, ++it) {
+    EXPECT_EQ(*mit, *it);
+    EXPECT_EQ(*mit.flip(), *it.flip());
+    EXPECT_EQ(mit.flip().flip(), mit);
+  }
+  auto rit = b.end_right();
+  for (auto mit = m.end_right(); mit != m.begin_right();) {
+    EXPECT_EQ(*--mit, *--rit);
+  }
+  EXPECT_THROW(
+      (mapped_bimap<int, float, std::greater<>>(image.data(), data.size())),
+      std::runtime_error);
+}
+
+#ifdef BIMAP_HAS_MMAP
+TEST(mapped_bimap, open_file) {
+  bimap<uint64_t, uint32_t> b;
+  for (uint32_t i = 0; i < 1000; i++) {
+    b.insert(uint64_t(i) << 32, 1000 - i);
+  }
+  auto path = std::filesystem::temp_directory_path() /
+              ("mapped_bimap_" + std::to_string(std::random_device()()));
+  {
+    std::ofstream out(path, std::ios::binary);
+    mapped_bimap<uint64_t, uint32_t>::write(out, b);
+  }
+  auto m = mapped_bimap<uint64_t, uint32_t>::open(path.c_str());
+  std::filesystem::remove(path);
+  EXPECT_EQ(m.size(), 1000);
+  EXPECT_EQ(m.at_right(1), uint64_t(999) << 32);
+  EXPECT_EQ(*m.begin_right().flip(), uint64_t(999) << 32);
+}
+#endif
+
+namespace {
+
+enum class opcode { nop, load, store, jump };
+
+constexpr auto mnemonics = make_static_bimap<opcode, std::string_view>({
+    {opcode::store, "st"},
+    {opcode::nop, "nop"},
+    {opcode::jump, "jmp"},
+    {opcode::load, "ld"},
+});
+
+static_assert(mnemonics.size() == 4);
+static_assert(mnemonics.at_left(opcode::load) == "ld");
+static_assert(mnemonics.at_right("jmp") == opcode::jump);
+static_assert(mnemonics.find_right("add") == mnemonics.end_right());
+static_assert(*mnemonics.begin_right() == "jmp");
+static_assert(*mnemonics.begin_right().flip() == opcode::jump);
+
+} // namespace
+
+TEST(static_bimap, queries) {
+  std::vector<std::string_view> names;
+  for (auto it = mnemonics.begin_left(); it != mnemonics.end_left(); ++it) {
+    names.push_back(*it.flip());
+  }
+  EXPECT_EQ(names, (std::vector<std::string_view>{"nop", "ld", "st", "jmp"}));
+  EXPECT_EQ(mnemonics.at_right("st"), opcode::store);
+  EXPECT_EQ(*mnemonics.lower_bound_right("m").flip(), opcode::nop);
+  EXPECT_EQ(mnemonics.upper_bound_left(opcode::jump), mnemonics.end_left());
+  EXPECT_THROW(mnemonics.at_right("add"), std::out_of_range);
+
+  auto reversed = make_static_bimap<int, int, std::greater<int>>(
+      {{1, 10}, {2, 20}, {3, 30}});
+  EXPECT_EQ(*reversed.begin_left(), 3);
+  EXPECT_EQ(reversed.at_left(2), 20);
+
+  EXPECT_THROW((make_static_bimap<int, int>({{1, 10}, {2, 20}, {1, 30}})),
+               std::invalid_argument);
+  EXPECT_THROW((make_static_bimap<int, int>({{1, 10}, {2, 10}})),
+               std::invalid_argument);
+}
+
+TEST(traced_bimap, replay_reproduces_state) {
+  std::stringstream log;
+  bimap<int, std::string> initial;
+  initial.insert(100, "hundred");
+  traced_bimap<int, std::string> t(log, std::move(initial));
+  for (int i = 0; i < 20; i++) {
+    t.insert(i, std::to_string(i * 7));
+  }
+  t.erase_left(3);
+  t.erase_right("14");
+  t.erase_left(t.find_left(5));
+  t.erase_right(t.find_right("42"));
+  t.erase_left(t.find_left(8), t.find_left(11));
+  t.erase_right(t.lower_bound_right("9"), t.end_right());
+  EXPECT_EQ(t.at_left(0), "0");
+  EXPECT_THROW(t.at_right("none"), std::out_of_range);
+  t.insert_or_assign_left(0, "zero");
+  t.insert_or_assign_right("zero", 1);
+  t.try_emplace_left(50, 3, 'x');
+  t.try_emplace_right("fifty", 51);
+  t.upper_bound_left(12);
+  EXPECT_EQ(t.at_left_or_default(60), "");
+  t.flush();
+
+  bimap<int, std::string> replayed;
+  std::size_t operations = 0;
+  auto count = replay_trace(log, replayed, [&](trace_op, auto&& perform) {
+    operations++;
+    perform();
+  });
+  EXPECT_EQ(count, 40);
+  EXPECT_EQ(operations, count);
+  EXPECT_EQ(replayed, t.underlying());
+  EXPECT_EQ(replayed.at_right("xxx"), 50);
+
+  log.clear();
+  log.seekg(0);
+  bimap<int, int> wrong_types;
+  EXPECT_THROW(replay_trace(log, wrong_types, [](trace_op, auto&&) {}),
+               std::runtime_error);
+}
+
 template <typename T>
 std::vector<std::pair<T, T>>
 eliminate_same(std::vector<T>& lefts, std::vector<T>& rights, std::mt19937& e) {
@@ -589,3 +1755,414 @@ TEST(bimap_randomized, compare_to_two_maps) {
   std::cout << "Performed " << ins << " insertions and " << total - ins - skip
             << " erasures. " << skip << " skipped." << std::endl;
 }
+
+TEST(bimap_randomized, erase_range_compare_to_two_maps) {
+  std::cout << "Seed used for randomized erase range test is " << seed
+            << std::endl;
+
+  bimap<int, int> b;
+  std::map<int, int> left_view, right_view;
+
+  std::mt19937 e(seed);
+  for (size_t i = 0; i < 2000; i++) {
+    for (size_t j = e() % 50; j > 0; j--) {
+      int l = e() % 100000, r = e() % 100000;
+      if (b.insert(l, r) != b.end_left()) {
+        left_view.insert({l, r});
+        right_view.insert({r, l});
+      }
+    }
+
+    int from = e() % 100000, to = from + e() % (i % 2 == 0 ? 1000 : 50000);
+    if (i % 3 == 0) {
+      auto first = left_view.lower_bound(from);
+      auto last = left_view.lower_bound(to);
+      for (auto it = first; it != last; ++it) {
+        right_view.erase(it->second);
+      }
+      left_view.erase(first, last);
+      auto it = b.erase_left(b.lower_bound_left(from), b.lower_bound_left(to));
+      EXPECT_EQ(it, b.lower_bound_left(to));
+    } else {
+      auto first = right_view.lower_bound(from);
+      auto last = right_view.lower_bound(to);
+      for (auto it = first; it != last; ++it) {
+        left_view.erase(it->second);
+      }
+      right_view.erase(first, last);
+      auto it =
+          b.erase_right(b.lower_bound_right(from), b.lower_bound_right(to));
+      EXPECT_EQ(it, b.lower_bound_right(to));
+    }
+
+    ASSERT_EQ(b.size(), left_view.size());
+    ASSERT_EQ(b.size(), right_view.size());
+    if (i % 50 == 0) {
+      auto lit = b.begin_left();
+      for (auto const& [l, r] : left_view) {
+        EXPECT_EQ(*lit, l);
+        EXPECT_EQ(*lit.flip(), r);
+        lit++;
+      }
+      auto rit = b.begin_right();
+      for (auto const& [r, l] : right_view) {
+        EXPECT_EQ(*rit, r);
+        EXPECT_EQ(*rit.flip(), l);
+        rit++;
+      }
+    }
+  }
+}
+
+TEST(bimap_randomized, diff_apply) {
+  std::cout << "Seed used for randomized diff test is " << seed << std::endl;
+
+  std::mt19937 e(seed);
+  for (size_t i = 0; i < 200; i++) {
+    bimap<int, int> a, b;
+    int range = 10 + e() % 1000;
+    for (size_t j = e() % 2000; j > 0; j--) {
+      int l = e() % range, r = e() % range;
+      a.insert(l, r);
+      if (e() % 4 != 0) {
+        b.insert(l, e() % 8 == 0 ? r + 1 : r);
+      }
+    }
+    for (size_t j = e() % 100; j > 0; j--) {
+      b.insert(e() % range, e() % range);
+    }
+
+    auto patch = diff(a, b);
+    a.apply(patch);
+    ASSERT_EQ(a, b);
+    ASSERT_TRUE(diff(a, b).empty());
+  }
+}
+
+namespace {
+using pairs = std::map<int, int>;
+
+bool conflicts(std::pair<int, int> const& pair, pairs const& left_view,
+               pairs const& right_view) {
+  auto l = left_view.find(pair.first);
+  auto r = right_view.find(pair.second);
+  return (l != left_view.end() && l->second != pair.second) ||
+         (r != right_view.end() && r->second != pair.first);
+}
+
+pairs expected_set_algebra(int op, pairs const& a, pairs const& b,
+                           bimap_conflict policy) {
+  pairs a_right, b_right, result;
+  for (auto [l, r] : a) {
+    a_right[r] = l;
+  }
+  for (auto [l, r] : b) {
+    b_right[r] = l;
+  }
+  for (auto const& pair : a) {
+    bool same = b.count(pair.first) && b.at(pair.first) == pair.second;
+    bool conflict = conflicts(pair, b, b_right);
+    bool keep = op == 0   ? !conflict || policy == bimap_conflict::keep_first
+                : op == 1 ? same || (conflict &&
+                                     policy == bimap_conflict::keep_first)
+                          : !same && (!conflict ||
+                                      policy == bimap_conflict::keep_first);
+    if (keep) {
+      result.insert(pair);
+    }
+  }
+  for (auto const& pair : b) {
+    bool conflict = conflicts(pair, a, a_right);
+    bool keep = op == 0 ? !conflict || policy == bimap_conflict::keep_second
+                : op == 1 ? conflict && policy == bimap_conflict::keep_second
+                          : false;
+    if (keep) {
+      result.insert(pair);
+    }
+  }
+  return result;
+}
+} // namespace
+
+TEST(bimap_randomized, set_algebra) {
+  std::cout << "Seed used for randomized set algebra test is " << seed
+            << std::endl;
+
+  std::mt19937 e(seed);
+  for (size_t i = 0; i < 300; i++) {
+    bimap<int, int> a, b;
+    pairs a_pairs, b_pairs;
+    int range = 5 + e() % 2000;
+    for (size_t j = e() % 1000; j > 0; j--) {
+      int l = e() % range, r = e() % range;
+      if (a.insert(l, r) != a.end_left()) {
+        a_pairs[l] = r;
+      }
+    }
+    for (size_t j = e() % (i % 2 == 0 ? 1000 : 30); j > 0; j--) {
+      int l = e() % range, r = e() % range;
+      if (e() % 2 == 0 && !a_pairs.empty()) {
+        auto it = a_pairs.lower_bound(l);
+        if (it != a_pairs.end()) {
+          std::tie(l, r) = *it;
+        }
+      }
+      if (b.insert(l, r) != b.end_left()) {
+        b_pairs[l] = r;
+      }
+    }
+
+    int op = e() % 3;
+    auto policy = static_cast<bimap_conflict>(e() % 3);
+    bool move_a = e() % 2, move_b = e() % 2;
+    auto copy_a = a, copy_b = b;
+    bimap<int, int> result;
+    if (op == 0) {
+      result = move_a ? move_b ? bimap_union(std::move(copy_a),
+                                             std::move(copy_b), policy)
+                               : bimap_union(std::move(copy_a), b, policy)
+               : move_b ? bimap_union(a, std::move(copy_b), policy)
+                        : bimap_union(a, b, policy);
+    } else if (op == 1) {
+      result = move_a ? move_b ? bimap_intersection(std::move(copy_a),
+                                                    std::move(copy_b), policy)
+                               : bimap_intersection(std::move(copy_a), b,
+                                                    policy)
+               : move_b ? bimap_intersection(a, std::move(copy_b), policy)
+                        : bimap_intersection(a, b, policy);
+    } else {
+      result = move_a ? bimap_difference(std::move(copy_a), b, policy)
+                      : bimap_difference(a, b, policy);
+    }
+
+    auto expected = expected_set_algebra(op, a_pairs, b_pairs, policy);
+    ASSERT_EQ(result.size(), expected.size());
+    auto it = result.begin_left();
+    for (auto const& [l, r] : expected) {
+      ASSERT_EQ(*it, l);
+      ASSERT_EQ(*it.flip(), r);
+      it++;
+    }
+  }
+}
+
+TEST(bimap_randomized, upsert_compare_to_two_maps) {
+  std::cout << "Seed used for randomized upsert test is " << seed
+            << std::endl;
+
+  bimap<int, int> b;
+  std::map<int, int> left_view, right_view;
+
+  std::mt19937 e(seed);
+  for (size_t i = 0; i < 100000; i++) {
+    int l = e() % 1000, r = e() % 1000;
+    bool assign = e() % 2;
+    bool from_left = e() % 2;
+    if (!from_left) {
+      std::swap(l, r);
+      std::swap(left_view, right_view);
+    }
+
+    bool has_key = left_view.count(l);
+    bool same = has_key && left_view[l] == r;
+    bool evicts = right_view.count(r) && !same;
+    if (!has_key || (assign && !same)) {
+      if (has_key) {
+        right_view.erase(left_view[l]);
+      }
+      if (evicts) {
+        left_view.erase(right_view[r]);
+      }
+      left_view[l] = r;
+      right_view[r] = l;
+    }
+    if (!from_left) {
+      std::swap(l, r);
+      std::swap(left_view, right_view);
+    }
+
+    bimap_upsert status;
+    bool evicted;
+    if (from_left) {
+      auto result = assign ? b.insert_or_assign_left(l, r)
+                           : b.try_emplace_left(l, r);
+      EXPECT_EQ(*result.position, l);
+      status = result.status;
+      evicted = result.evicted;
+    } else {
+      auto result = assign ? b.insert_or_assign_right(r, l)
+                           : b.try_emplace_right(r, l);
+      EXPECT_EQ(*result.position, r);
+      status = result.status;
+      evicted = result.evicted;
+    }
+    EXPECT_EQ(status, !has_key ? bimap_upsert::inserted
+                      : same || !assign ? bimap_upsert::found
+                                        : bimap_upsert::assigned);
+    EXPECT_EQ(evicted, status != bimap_upsert::found && evicts);
+
+    ASSERT_EQ(b.size(), left_view.size());
+    if (i % 1000 == 0) {
+      auto lit = b.begin_left();
+      for (auto const& [l, r] : left_view) {
+        EXPECT_EQ(*lit, l);
+        EXPECT_EQ(*lit.flip(), r);
+        lit++;
+      }
+      auto rit = b.begin_right();
+      for (auto const& [r, l] : right_view) {
+        EXPECT_EQ(*rit, r);
+        rit++;
+      }
+    }
+  }
+}
+
+TEST(bimap_randomized, lookup_cache_compare_to_uncached) {
+  // Маленький кэш, чтобы ключи постоянно делили слоты
+  bimap<int, int, std::less<int>, std::less<int>,
+        bimap_policy::lookup_cache<8>, bimap_policy::small_buffer<4>>
+      cached;
+  bimap<int, int> plain;
+  std::mt19937 e(seed);
+  for (size_t i = 0; i < 100000; i++) {
+    int l = e() % 200;
+    int r = e() % 200;
+    switch (e() % 8) {
+    case 0:
+      EXPECT_EQ(cached.insert(l, r) == cached.end_left(),
+                plain.insert(l, r) == plain.end_left());
+      break;
+    case 1:
+      EXPECT_EQ(cached.erase_left(l), plain.erase_left(l));
+      break;
+    case 2:
+      EXPECT_EQ(cached.erase_right(r), plain.erase_right(r));
+      break;
+    case 3:
+      cached.insert_or_assign_left(l, r);
+      plain.insert_or_assign_left(l, r);
+      break;
+    case 4:
+      cached.insert_or_assign_right(r, l);
+      plain.insert_or_assign_right(r, l);
+      break;
+    case 5:
+      if (i % 1000 == 5) {
+        cached.erase_left(cached.lower_bound_left(l), cached.end_left());
+        plain.erase_left(plain.lower_bound_left(l), plain.end_left());
+      }
+      break;
+    default: {
+      auto it = cached.find_left(l);
+      auto plain_it = plain.find_left(l);
+      ASSERT_EQ(it == cached.end_left(), plain_it == plain.end_left());
+      if (it != cached.end_left()) {
+        EXPECT_EQ(*it.flip(), *plain_it.flip());
+      }
+      auto rit = cached.find_right(r);
+      auto plain_rit = plain.find_right(r);
+      ASSERT_EQ(rit == cached.end_right(), plain_rit == plain.end_right());
+      if (rit != cached.end_right()) {
+        EXPECT_EQ(*rit.flip(), *plain_rit.flip());
+      }
+    }
+    }
+    if (i % 10000 == 0) {
+      auto copy = cached;
+      cached = std::move(copy);
+    }
+  }
+  EXPECT_GT(cached.cache_stats().left.hits, 0);
+  EXPECT_EQ(cached.size(), plain.size());
+  auto it = cached.begin_left();
+  for (auto plain_it = plain.begin_left(); plain_it != plain.end_left();
+       ++plain_it, ++it) {
+    EXPECT_EQ(*it, *plain_it);
+    EXPECT_EQ(*it.flip(), *plain_it.flip());
+  }
+}
+
+TEST(bimap_randomized, radix_index_compare_to_plain) {
+  using indexed_bimap =
+      bimap<std::int64_t, std::uint16_t, std::less<std::int64_t>,
+            std::less<std::uint16_t>, bimap_policy::radix_index,
+            bimap_policy::small_buffer<4>>;
+  indexed_bimap indexed;
+  bimap<std::int64_t, std::uint16_t> plain;
+  std::mt19937_64 e(seed);
+  // Ключи с общими старшими байтами и разреженные, чтобы были и длинные
+  // сжатые пути, и их разбиения
+  auto random_left = [&] {
+    auto x = static_cast<std::int64_t>(e());
+    return e() % 2 ? x >> (e() % 64) : x % 1000;
+  };
+  for (size_t i = 0; i < 100000; i++) {
+    auto l = random_left();
+    auto r = static_cast<std::uint16_t>(e() % 2000);
+    switch (e() % 8) {
+    case 0:
+    case 1:
+      EXPECT_EQ(indexed.insert(l, r) == indexed.end_left(),
+                plain.insert(l, r) == plain.end_left());
+      break;
+    case 2:
+      EXPECT_EQ(indexed.erase_right(r), plain.erase_right(r));
+      break;
+    case 3:
+      indexed.insert_or_assign_left(l, r);
+      plain.insert_or_assign_left(l, r);
+      break;
+    case 4:
+      indexed.insert_or_assign_right(r, l);
+      plain.insert_or_assign_right(r, l);
+      break;
+    case 5:
+      if (i % 1000 == 5) {
+        indexed.erase_left(indexed.lower_bound_left(l), indexed.end_left());
+        plain.erase_left(plain.lower_bound_left(l), plain.end_left());
+      } else {
+        EXPECT_EQ(indexed.erase_left(l), plain.erase_left(l));
+      }
+      break;
+    default: {
+      auto it = indexed.lower_bound_left(l);
+      auto plain_it = plain.lower_bound_left(l);
+      ASSERT_EQ(it == indexed.end_left(), plain_it == plain.end_left());
+      if (it != indexed.end_left()) {
+        EXPECT_EQ(*it, *plain_it);
+        EXPECT_EQ(*it.flip(), *plain_it.flip());
+        EXPECT_EQ(indexed.find_left(*it), it);
+      }
+      auto uit = indexed.upper_bound_left(l);
+      auto plain_uit = plain.upper_bound_left(l);
+      ASSERT_EQ(uit == indexed.end_left(), plain_uit == plain.end_left());
+      if (uit != indexed.end_left()) {
+        EXPECT_EQ(*uit, *plain_uit);
+      }
+      auto rit = indexed.lower_bound_right(r);
+      auto plain_rit = plain.lower_bound_right(r);
+      ASSERT_EQ(rit == indexed.end_right(), plain_rit == plain.end_right());
+      if (rit != indexed.end_right()) {
+        EXPECT_EQ(*rit.flip(), *plain_rit.flip());
+      }
+    }
+    }
+    if (i % 10000 == 0) {
+      auto copy = indexed;
+      indexed_bimap other;
+      other.insert(l, r);
+      indexed.swap(other);
+      indexed = std::move(copy);
+      indexed.compact();
+    }
+  }
+  EXPECT_EQ(indexed.size(), plain.size());
+  auto it = indexed.begin_left();
+  for (auto plain_it = plain.begin_left(); plain_it != plain.end_left();
+       ++plain_it, ++it) {
+    EXPECT_EQ(*it, *plain_it);
+    EXPECT_EQ(indexed.find_left(*plain_it), it);
+    EXPECT_EQ(*indexed.find_right(*plain_it.flip()).flip(), *plain_it);
+  }
+}
@@ -0,0 +1,210 @@
+// Проигрывает лог traced_bimap и печатает пропускную способность и
+// гистограммы задержек по операциям:
+//   trace_replay <log> [default|small_buffer|stats]
+// stats дополнительно печатает счетчики bimap_policy::collect_stats.
+// Время каждой операции меряется парой steady_clock::now(), их накладные
+// расходы (десятки наносекунд) входят в задержку.
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "traced-bimap.h"
+
+namespace {
+
+// Корзина i - задержки в [2^i, 2^(i+1)) наносекунд
+constexpr std::size_t bucket_count = 40;
+
+struct op_latency {
+  std::array<std::uint64_t, bucket_count> buckets{};
+  std::uint64_t count = 0;
+  std::uint64_t total_ns = 0;
+  std::uint64_t max_ns = 0;
+
+  void add(std::uint64_t ns) {
+    std::size_t bucket = 0;
+    while (bucket + 1 < bucket_count && (ns >> (bucket + 1)) != 0) {
+      bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    total_ns += ns;
+    max_ns = std::max(max_ns, ns);
+  }
+
+  // Верхняя граница корзины, в которой лежит квантиль q
+  std::uint64_t quantile(double q) const {
+    auto rank = static_cast<std::uint64_t>(q * (count - 1));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; i++) {
+      seen += buckets[i];
+      if (seen > rank) {
+        return std::uint64_t(2) << i;
+      }
+    }
+    return max_ns;
+  }
+};
+
+void print_report(std::array<op_latency, trace_op_count> const& latencies,
+                  std::size_t count, double seconds) {
+  std::printf("%zu operations in %.3f s, %.0f ops/s\n\n", count, seconds,
+              count / seconds);
+  std::printf("%-24s %10s %10s %10s %10s %10s %10s\n", "operation", "count",
+              "mean ns", "p50 <=", "p90 <=", "p99 <=", "max ns");
+  for (std::size_t op = 0; op < trace_op_count; op++) {
+    auto const& latency = latencies[op];
+    if (latency.count == 0) {
+      continue;
+    }
+    std::printf("%-24s %10llu %10.0f %10llu %10llu %10llu %10llu\n",
+                trace_op_name(static_cast<trace_op>(op)),
+                static_cast<unsigned long long>(latency.count),
+                double(latency.total_ns) / latency.count,
+                static_cast<unsigned long long>(latency.quantile(0.5)),
+                static_cast<unsigned long long>(latency.quantile(0.9)),
+                static_cast<unsigned long long>(latency.quantile(0.99)),
+                static_cast<unsigned long long>(latency.max_ns));
+  }
+
+  std::printf("\nhistograms, ns:\n");
+  for (std::size_t op = 0; op < trace_op_count; op++) {
+    auto const& latency = latencies[op];
+    if (latency.count == 0) {
+      continue;
+    }
+    std::printf("%s\n", trace_op_name(static_cast<trace_op>(op)));
+    for (std::size_t i = 0; i < bucket_count; i++) {
+      if (latency.buckets[i] == 0) {
+        continue;
+      }
+      auto percent = 100.0 * latency.buckets[i] / latency.count;
+      std::printf("  [%12llu, %12llu) %10llu %6.2f%% ",
+                  static_cast<unsigned long long>(i == 0 ? 0 : 1ull << i),
+                  static_cast<unsigned long long>(2ull << i),
+                  static_cast<unsigned long long>(latency.buckets[i]),
+                  percent);
+      for (int bar = 0; bar < percent / 2; bar++) {
+        std::putchar('#');
+      }
+      std::putchar('\n');
+    }
+  }
+}
+
+// Есть ли у Bimap stats(), то есть bimap_policy::collect_stats
+template <typename Bimap, typename = void>
+constexpr bool has_stats = false;
+
+template <typename Bimap>
+constexpr bool has_stats<
+    Bimap, std::void_t<decltype(std::declval<Bimap const&>().stats())>> =
+    true;
+
+template <typename Bimap>
+void replay(std::istream& in) {
+  using clock = std::chrono::steady_clock;
+  std::array<op_latency, trace_op_count> latencies;
+  Bimap map;
+
+  auto start = clock::now();
+  auto count = replay_trace(in, map, [&](trace_op op, auto&& perform) {
+    auto before = clock::now();
+    perform();
+    auto after = clock::now();
+    latencies[static_cast<std::size_t>(op)].add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(after - before)
+            .count());
+  });
+  std::chrono::duration<double> elapsed = clock::now() - start;
+
+  print_report(latencies, count, elapsed.count());
+  std::printf("\nfinal size: %zu\n", map.size());
+  if constexpr (has_stats<Bimap>) {
+    auto stats = map.stats();
+    std::printf("left: %zu comparisons, %zu rotations, max depth %zu\n",
+                stats.left.comparisons, stats.left.rotations,
+                stats.left.max_depth);
+    std::printf("right: %zu comparisons, %zu rotations, max depth %zu\n",
+                stats.right.comparisons, stats.right.rotations,
+                stats.right.max_depth);
+    std::printf("node allocations: %zu\n", stats.allocations);
+  }
+}
+
+template <typename Left, typename Right>
+void replay_with(std::istream& in, std::string const& config) {
+  if (config == "default") {
+    replay<bimap<Left, Right>>(in);
+  } else if (config == "small_buffer") {
+    replay<bimap<Left, Right, std::less<Left>, std::less<Right>,
+                 bimap_policy::small_buffer<16>>>(in);
+  } else if (config == "stats") {
+    replay<bimap<Left, Right, std::less<Left>, std::less<Right>,
+                 bimap_policy::collect_stats>>(in);
+  } else {
+    throw std::runtime_error("unknown configuration " + config);
+  }
+}
+
+template <typename Left>
+void dispatch_right(std::istream& in, std::uint8_t right_type,
+                    std::string const& config) {
+  switch (right_type) {
+  case tracing::type_code<std::int32_t>:
+    return replay_with<Left, std::int32_t>(in, config);
+  case tracing::type_code<std::int64_t>:
+    return replay_with<Left, std::int64_t>(in, config);
+  case tracing::type_code<std::string>:
+    return replay_with<Left, std::string>(in, config);
+  default:
+    throw std::runtime_error("trace has keys of an unsupported type");
+  }
+}
+
+void dispatch(std::istream& in, tracing::header header,
+              std::string const& config) {
+  switch (header.left_type) {
+  case tracing::type_code<std::int32_t>:
+    return dispatch_right<std::int32_t>(in, header.right_type, config);
+  case tracing::type_code<std::int64_t>:
+    return dispatch_right<std::int64_t>(in, header.right_type, config);
+  case tracing::type_code<std::string>:
+    return dispatch_right<std::string>(in, header.right_type, config);
+  default:
+    throw std::runtime_error("trace has keys of an unsupported type");
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 3) {
+    std::fprintf(stderr, "usage: %s <log> [default|small_buffer|stats]\n",
+                 argv[0]);
+    return 2;
+  }
+  try {
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+      throw std::runtime_error(std::string("can't open ") + argv[1]);
+    }
+    auto header = tracing::read_header(in);
+    // replay_trace сам читает и проверяет заголовок
+    in.seekg(0);
+    dispatch(in, header, argc == 3 ? argv[2] : "default");
+  } catch (std::exception const& e) {
+    std::fprintf(stderr, "trace_replay: %s\n", e.what());
+    return 1;
+  }
+}
@@ -0,0 +1,436 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "bimap.h"
+#include "serializer.h"
+
+// Операции в логе traced_bimap. Номера входят в формат лога.
+enum class trace_op : std::uint8_t {
+  insert,
+  erase_left,
+  erase_right,
+  erase_left_range,
+  erase_right_range,
+  find_left,
+  find_right,
+  at_left,
+  at_right,
+  lower_bound_left,
+  upper_bound_left,
+  lower_bound_right,
+  upper_bound_right,
+  at_left_or_default,
+  at_right_or_default,
+  insert_or_assign_left,
+  insert_or_assign_right,
+  try_emplace_left,
+  try_emplace_right,
+};
+
+inline constexpr std::size_t trace_op_count =
+    static_cast<std::size_t>(trace_op::try_emplace_right) + 1;
+
+inline char const* trace_op_name(trace_op op) {
+  constexpr char const* names[trace_op_count] = {
+      "insert",
+      "erase_left",
+      "erase_right",
+      "erase_left_range",
+      "erase_right_range",
+      "find_left",
+      "find_right",
+      "at_left",
+      "at_right",
+      "lower_bound_left",
+      "upper_bound_left",
+      "lower_bound_right",
+      "upper_bound_right",
+      "at_left_or_default",
+      "at_right_or_default",
+      "insert_or_assign_left",
+      "insert_or_assign_right",
+      "try_emplace_left",
+      "try_emplace_right",
+  };
+  return names[static_cast<std::size_t>(op)];
+}
+
+namespace tracing {
+
+// Лог: заголовок {magic, код типа left, код типа right}, затем записи
+// {trace_op, ключи через bimap_serializer}. У erase_*_range перед ключами
+// байт флагов: end_first и end_last вместо соответствующего ключа.
+inline constexpr std::uint64_t magic = 0x4249'4d41'5054'3031ULL;
+
+inline constexpr std::uint8_t end_first = 1;
+inline constexpr std::uint8_t end_last = 2;
+
+// Коды типов, по которым trace_replay выбирает bimap. 0 - свой тип,
+// такой лог проигрывается только через replay_trace.
+template <typename T>
+inline constexpr std::uint8_t type_code = 0;
+template <>
+inline constexpr std::uint8_t type_code<std::int32_t> = 1;
+template <>
+inline constexpr std::uint8_t type_code<std::int64_t> = 2;
+template <>
+inline constexpr std::uint8_t type_code<std::string> = 3;
+
+struct header {
+  std::uint8_t left_type;
+  std::uint8_t right_type;
+};
+
+inline void write_header(std::ostream& out, std::uint8_t left_type,
+                         std::uint8_t right_type) {
+  bimap_serializer<std::uint64_t>::save(out, magic);
+  bimap_serializer<std::uint8_t>::save(out, left_type);
+  bimap_serializer<std::uint8_t>::save(out, right_type);
+}
+
+inline header read_header(std::istream& in) {
+  if (bimap_serializer<std::uint64_t>::load(in) != magic) {
+    throw std::runtime_error("bimap trace: bad magic");
+  }
+  header result;
+  result.left_type = bimap_serializer<std::uint8_t>::load(in);
+  result.right_type = bimap_serializer<std::uint8_t>::load(in);
+  return result;
+}
+
+} // namespace tracing
+
+// Обертка над bimap, которая пишет в лог каждую операцию с ключами, см.
+// replay_trace и trace_replay. Итераторы - итераторы самого bimap, операции
+// над ними (flip, ++) не пишутся; erase по итераторам пишется ключами.
+// Начальные пары map пишутся как insert.
+template <typename Left, typename Right, typename... Params>
+class traced_bimap {
+public:
+  using bimap_t = bimap<Left, Right, Params...>;
+  using left_iterator = typename bimap_t::left_iterator;
+  using right_iterator = typename bimap_t::right_iterator;
+
+  explicit traced_bimap(std::ostream& log, bimap_t map = bimap_t())
+      : map(std::move(map)), log(&log) {
+    tracing::write_header(log, tracing::type_code<Left>,
+                          tracing::type_code<Right>);
+    for (auto it = this->map.begin_left(); it != this->map.end_left(); ++it) {
+      record(trace_op::insert, *it, *it.flip());
+    }
+  }
+
+  // Доступ без записи в лог
+  bimap_t const& underlying() const {
+    return map;
+  }
+
+  void flush() {
+    log->flush();
+  }
+
+  left_iterator insert(Left left, Right right) {
+    record(trace_op::insert, left, right);
+    return map.insert(std::move(left), std::move(right));
+  }
+
+  left_iterator erase_left(left_iterator it) {
+    record(trace_op::erase_left, *it);
+    return map.erase_left(it);
+  }
+  bool erase_left(Left const& left) {
+    record(trace_op::erase_left, left);
+    return map.erase_left(left);
+  }
+  right_iterator erase_right(right_iterator it) {
+    record(trace_op::erase_right, *it);
+    return map.erase_right(it);
+  }
+  bool erase_right(Right const& right) {
+    record(trace_op::erase_right, right);
+    return map.erase_right(right);
+  }
+
+  left_iterator erase_left(left_iterator first, left_iterator last) {
+    record_range(trace_op::erase_left_range, first, last, map.end_left());
+    return map.erase_left(first, last);
+  }
+  right_iterator erase_right(right_iterator first, right_iterator last) {
+    record_range(trace_op::erase_right_range, first, last, map.end_right());
+    return map.erase_right(first, last);
+  }
+
+  left_iterator find_left(Left const& left) const {
+    record(trace_op::find_left, left);
+    return map.find_left(left);
+  }
+  right_iterator find_right(Right const& right) const {
+    record(trace_op::find_right, right);
+    return map.find_right(right);
+  }
+
+  Right const& at_left(Left const& key) const {
+    record(trace_op::at_left, key);
+    return map.at_left(key);
+  }
+  Left const& at_right(Right const& key) const {
+    record(trace_op::at_right, key);
+    return map.at_right(key);
+  }
+
+  Right const& at_left_or_default(Left const& key) {
+    record(trace_op::at_left_or_default, key);
+    return map.at_left_or_default(key);
+  }
+  Left const& at_right_or_default(Right const& key) {
+    record(trace_op::at_right_or_default, key);
+    return map.at_right_or_default(key);
+  }
+
+  auto insert_or_assign_left(Left left, Right right) {
+    record(trace_op::insert_or_assign_left, left, right);
+    return map.insert_or_assign_left(std::move(left), std::move(right));
+  }
+  auto insert_or_assign_right(Right right, Left left) {
+    record(trace_op::insert_or_assign_right, right, left);
+    return map.insert_or_assign_right(std::move(right), std::move(left));
+  }
+
+  // Парное значение создается до вызова, чтобы попасть в лог
+  template <typename... Args>
+  auto try_emplace_left(Left left, Args&&... args) {
+    Right right(std::forward<Args>(args)...);
+    record(trace_op::try_emplace_left, left, right);
+    return map.try_emplace_left(std::move(left), std::move(right));
+  }
+  template <typename... Args>
+  auto try_emplace_right(Right right, Args&&... args) {
+    Left left(std::forward<Args>(args)...);
+    record(trace_op::try_emplace_right, right, left);
+    return map.try_emplace_right(std::move(right), std::move(left));
+  }
+
+  left_iterator lower_bound_left(Left const& left) const {
+    record(trace_op::lower_bound_left, left);
+    return map.lower_bound_left(left);
+  }
+  left_iterator upper_bound_left(Left const& left) const {
+    record(trace_op::upper_bound_left, left);
+    return map.upper_bound_left(left);
+  }
+  right_iterator lower_bound_right(Right const& right) const {
+    record(trace_op::lower_bound_right, right);
+    return map.lower_bound_right(right);
+  }
+  right_iterator upper_bound_right(Right const& right) const {
+    record(trace_op::upper_bound_right, right);
+    return map.upper_bound_right(right);
+  }
+
+  left_iterator begin_left() const {
+    return map.begin_left();
+  }
+  left_iterator end_left() const {
+    return map.end_left();
+  }
+  right_iterator begin_right() const {
+    return map.begin_right();
+  }
+  right_iterator end_right() const {
+    return map.end_right();
+  }
+
+  bool empty() const {
+    return map.empty();
+  }
+  std::size_t size() const {
+    return map.size();
+  }
+
+private:
+  template <typename... Keys>
+  void record(trace_op op, Keys const&... keys) const {
+    bimap_serializer<std::uint8_t>::save(*log, static_cast<std::uint8_t>(op));
+    (bimap_serializer<Keys>::save(*log, keys), ...);
+  }
+
+  template <typename Iterator>
+  void record_range(trace_op op, Iterator first, Iterator last,
+                    Iterator end) const {
+    std::uint8_t flags = (first == end ? tracing::end_first : 0) |
+                         (last == end ? tracing::end_last : 0);
+    record(op, flags);
+    if (first != end) {
+      bimap_serializer<typename Iterator::value_type>::save(*log, *first);
+    }
+    if (last != end) {
+      bimap_serializer<typename Iterator::value_type>::save(*log, *last);
+    }
+  }
+
+  bimap_t map;
+  std::ostream* log;
+};
+
+// Выполняет операции лога над map. Для каждой вызывает run(op, f), где f
+// выполняет операцию: ключи уже прочитаны, так что run может мерить время
+// одного f. Возвращает число операций. Бросает std::runtime_error на битом
+// логе или если типы лога не совпадают с типами map.
+template <typename Bimap, typename Run>
+std::size_t replay_trace(std::istream& in, Bimap& map, Run&& run) {
+  using left_t = typename Bimap::left_iterator::value_type;
+  using right_t = typename Bimap::right_iterator::value_type;
+
+  auto header = tracing::read_header(in);
+  if (header.left_type != tracing::type_code<left_t> ||
+      header.right_type != tracing::type_code<right_t>) {
+    throw std::runtime_error("bimap trace: key types don't match");
+  }
+
+  // Результаты пишутся сюда, чтобы компилятор не выбросил поиск
+  volatile bool found = false;
+  void const* volatile value = nullptr;
+  std::size_t count = 0;
+  for (int code; (code = in.get()) != std::istream::traits_type::eof();
+       count++) {
+    if (code >= static_cast<int>(trace_op_count)) {
+      throw std::runtime_error("bimap trace: unknown operation");
+    }
+    auto op = static_cast<trace_op>(code);
+    auto load_left = [&] {
+      return bimap_serializer<left_t>::load(in);
+    };
+    auto load_right = [&] {
+      return bimap_serializer<right_t>::load(in);
+    };
+
+    switch (op) {
+    case trace_op::insert:
+    case trace_op::insert_or_assign_left:
+    case trace_op::try_emplace_left: {
+      auto left = load_left();
+      auto right = load_right();
+      run(op, [&] {
+        if (op == trace_op::insert) {
+          map.insert(std::move(left), std::move(right));
+        } else if (op == trace_op::insert_or_assign_left) {
+          map.insert_or_assign_left(std::move(left), std::move(right));
+        } else {
+          map.try_emplace_left(std::move(left), std::move(right));
+        }
+      });
+      break;
+    }
+    case trace_op::insert_or_assign_right:
+    case trace_op::try_emplace_right: {
+      auto right = load_right();
+      auto left = load_left();
+      run(op, [&] {
+        if (op == trace_op::insert_or_assign_right) {
+          map.insert_or_assign_right(std::move(right), std::move(left));
+        } else {
+          map.try_emplace_right(std::move(right), std::move(left));
+        }
+      });
+      break;
+    }
+    case trace_op::erase_left_range: {
+      auto flags = bimap_serializer<std::uint8_t>::load(in);
+      auto first = flags & tracing::end_first ? map.end_left()
+                                              : map.find_left(load_left());
+      auto last = flags & tracing::end_last ? map.end_left()
+                                            : map.find_left(load_left());
+      run(op, [&] { map.erase_left(first, last); });
+      break;
+    }
+    case trace_op::erase_right_range: {
+      auto flags = bimap_serializer<std::uint8_t>::load(in);
+      auto first = flags & tracing::end_first ? map.end_right()
+                                              : map.find_right(load_right());
+      auto last = flags & tracing::end_last ? map.end_right()
+                                            : map.find_right(load_right());
+      run(op, [&] { map.erase_right(first, last); });
+      break;
+    }
+    case trace_op::erase_left:
+    case trace_op::find_left:
+    case trace_op::at_left:
+    case trace_op::lower_bound_left:
+    case trace_op::upper_bound_left:
+    case trace_op::at_left_or_default: {
+      auto left = load_left();
+      run(op, [&] {
+        switch (op) {
+        case trace_op::erase_left:
+          found = map.erase_left(left);
+          break;
+        case trace_op::find_left:
+          found = map.find_left(left) != map.end_left();
+          break;
+        case trace_op::at_left:
+          try {
+            value = &map.at_left(left);
+          } catch (std::out_of_range const&) {
+            value = nullptr;
+          }
+          break;
+        case trace_op::lower_bound_left:
+          found = map.lower_bound_left(left) != map.end_left();
+          break;
+        case trace_op::upper_bound_left:
+          found = map.upper_bound_left(left) != map.end_left();
+          break;
+        default:
+          if constexpr (std::is_default_constructible_v<right_t>) {
+            value = &map.at_left_or_default(left);
+          } else {
+            throw std::runtime_error("bimap trace: no default right value");
+          }
+        }
+      });
+      break;
+    }
+    default: {
+      auto right = load_right();
+      run(op, [&] {
+        switch (op) {
+        case trace_op::erase_right:
+          found = map.erase_right(right);
+          break;
+        case trace_op::find_right:
+          found = map.find_right(right) != map.end_right();
+          break;
+        case trace_op::at_right:
+          try {
+            value = &map.at_right(right);
+          } catch (std::out_of_range const&) {
+            value = nullptr;
+          }
+          break;
+        case trace_op::lower_bound_right:
+          found = map.lower_bound_right(right) != map.end_right();
+          break;
+        case trace_op::upper_bound_right:
+          found = map.upper_bound_right(right) != map.end_right();
+          break;
+        default:
+          if constexpr (std::is_default_constructible_v<left_t>) {
+            value = &map.at_right_or_default(right);
+          } else {
+            throw std::runtime_error("bimap trace: no default left value");
+          }
+        }
+      });
+    }
+    }
+  }
+  return count;
+}